@@ -0,0 +1,237 @@
+#ifndef COUNTERS_ATTACH_H_
+#define COUNTERS_ATTACH_H_
+
+#include "counters/event_counter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <dirent.h>
+#endif
+
+namespace counters {
+
+/// Events of an attached process or thread between two snapshots: one count
+/// per counted thread and their sum. Every count has the wall-clock time
+/// between the snapshots as its elapsed time.
+template <class Set> struct basic_attached_sample {
+  /// Thread IDs, in the order of `per_thread`.
+  std::vector<int> threads;
+  /// Each count has the coverage of its group over the interval (the share
+  /// of its running time during which the group was on the PMU), or 1 if
+  /// the thread did not run at all.
+  std::vector<basic_event_count<Set>> per_thread;
+  /// Counts summed over the threads; the coverage of each event is its
+  /// smallest over the threads.
+  basic_event_count<Set> total{};
+};
+
+namespace internal {
+// Thread IDs of process `pid`, from /proc/<pid>/task, in increasing order;
+// empty if the process does not exist.
+inline std::vector<int> task_ids(int pid) {
+  std::vector<int> tids;
+#if defined(__linux__)
+  const std::string path = "/proc/" + std::to_string(pid) + "/task";
+  DIR *dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return tids;
+  }
+  while (const dirent *entry = readdir(dir)) {
+    char *end = nullptr;
+    const long tid = std::strtol(entry->d_name, &end, 10);
+    if (end != entry->d_name && *end == '\0' && tid > 0) {
+      tids.push_back(int(tid));
+    }
+  }
+  closedir(dir);
+  std::sort(tids.begin(), tids.end());
+#else
+  (void)pid;
+#endif
+  return tids;
+}
+} // namespace internal
+
+/// Counts `Events...` (event tags from events.h, or a single event_set; an
+/// empty list selects default_event_set) in another process or thread that
+/// is already running, e.g. a production server that was not built with
+/// this library. It opens the same event group as event_collector against
+/// `pid` and leaves it counting; each snapshot() returns the counts since
+/// the previous one:
+///
+///   counters::attached_collector server(pid, true); // every thread
+///   for (;;) {
+///     std::this_thread::sleep_for(std::chrono::seconds(1));
+///     const auto &second = server.snapshot();
+///     printf("%.0f instructions/s\n", second.total.instructions());
+///   }
+///
+/// `pid` may be a process ID, which counts its main thread, or a thread ID.
+/// With `per_thread`, one group is opened for each thread listed in
+/// /proc/<pid>/task when attaching instead, and snapshots report each
+/// thread. Threads started later are only counted with
+/// collector_options::inherit, as part of the thread that started them;
+/// threads that exit keep their final counts. Only user-space events are
+/// counted, and attaching needs the permission to trace the target (the
+/// same user, or CAP_PERFMON / CAP_SYS_PTRACE). When nothing can be
+/// counted, has_events() is false and unavailable_reason() says why. Of the
+/// collector options, only `inherit` applies.
+template <class... Events> class basic_attached_collector {
+public:
+  using event_set_type = event_set_t<Events...>;
+  using sample_type = basic_attached_sample<event_set_type>;
+  static_assert(!event_set_type::is_runtime,
+                "attaching needs a static event set");
+
+  explicit basic_attached_collector(
+      int pid, bool per_thread = false,
+      const collector_options &opts = collector_options()) {
+#if defined(__linux__)
+    std::vector<perf_event_config> configs;
+    for (event_kind kind : event_set_type::kinds) {
+      configs.push_back(perf_config_for(kind));
+    }
+    std::vector<int> targets;
+    if (per_thread) {
+      targets = internal::task_ids(pid);
+    } else if (pid > 0) {
+      targets.push_back(pid);
+    }
+    int error = targets.empty() ? ESRCH : 0;
+    for (int tid : targets) {
+      perf_event_options target;
+      target.inherit = opts.inherit;
+      target.pid = tid;
+      LinuxEvents<PERF_TYPE_HARDWARE> group(configs, target);
+      if (!group.is_working()) {
+        error = group.open_error();
+        continue;
+      }
+      group.start();
+      tids.push_back(tid);
+      groups.push_back(std::move(group));
+    }
+    if (groups.empty()) {
+      reason = describe(pid, error);
+    }
+    previous.resize(groups.size());
+    for (size_t i = 0; i < groups.size(); i++) {
+      groups[i].read_running(previous[i].values, previous[i].enabled,
+                             previous[i].running);
+    }
+#else
+    (void)pid;
+    (void)per_thread;
+    (void)opts;
+    reason = "attaching needs Linux perf events";
+#endif
+    result.threads = tids;
+    result.per_thread.resize(tids.size());
+    last_clock = std::chrono::steady_clock::now();
+  }
+
+  /// Whether at least one thread is counted.
+  bool has_events() const { return !tids.empty(); }
+  /// Why nothing is counted when has_events() is false, empty otherwise.
+  const std::string &unavailable_reason() const { return reason; }
+  /// The thread IDs that are counted.
+  const std::vector<int> &counted_threads() const { return tids; }
+
+  /// Counts since attaching or since the previous snapshot(). The counters
+  /// keep running.
+  const sample_type &snapshot() {
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> elapsed = now - last_clock;
+    last_clock = now;
+    result.total = basic_event_count<event_set_type>{};
+    if (tids.empty()) {
+      result.total.coverage.fill(0);
+    }
+#if defined(__linux__)
+    for (size_t i = 0; i < groups.size(); i++) {
+      basic_event_count<event_set_type> &count = result.per_thread[i];
+      count.elapsed = elapsed;
+      read_delta(i, count);
+      result.total += count;
+    }
+#endif
+    result.total.elapsed = elapsed;
+    return result;
+  }
+
+private:
+  std::vector<int> tids;
+  std::string reason;
+  sample_type result;
+  std::chrono::time_point<std::chrono::steady_clock> last_clock{};
+#if defined(__linux__)
+  // Running totals of a group at the previous snapshot.
+  struct reading {
+    std::vector<uint64_t> values;
+    uint64_t enabled = 0;
+    uint64_t running = 0;
+  };
+  std::vector<LinuxEvents<PERF_TYPE_HARDWARE>> groups;
+  std::vector<reading> previous;
+  reading current;
+
+  void read_delta(size_t i, basic_event_count<event_set_type> &count) {
+    count.coverage.fill(0);
+    if (!groups[i].read_running(current.values, current.enabled,
+                                current.running)) {
+      count.event_counts.fill(0);
+      return;
+    }
+    reading &before = previous[i];
+    const uint64_t enabled = current.enabled - before.enabled;
+    const uint64_t running = current.running - before.running;
+    const float coverage =
+        enabled > 0 ? float(double(running) / double(enabled)) : 1;
+    for (size_t e = 0; e < event_set_type::size; e++) {
+      if (e < current.values.size()) {
+        const uint64_t base = e < before.values.size() ? before.values[e] : 0;
+        count.event_counts[e] = current.values[e] - base;
+        count.coverage[e] = coverage;
+      } else {
+        count.event_counts[e] = 0;
+      }
+    }
+    std::swap(before, current);
+  }
+
+  static std::string describe(int pid, int error) {
+    const std::string target = "process or thread " + std::to_string(pid);
+    if (error == ESRCH) {
+      return "no " + target;
+    }
+    if (error == EACCES || error == EPERM) {
+      return "not permitted to count " + target +
+             ": it needs the permission to trace it, and perf_event_paranoid "
+             "is " + std::to_string(perf_event_paranoid());
+    }
+    if (error == ENOENT || error == EOPNOTSUPP || error == ENODEV) {
+      return std::string("the events are not supported on this machine: ") +
+             std::strerror(error);
+    }
+    if (error == 0) {
+      return "no event could be scheduled for " + target;
+    }
+    return std::string("perf_event_open failed: ") + std::strerror(error);
+  }
+#endif
+};
+
+using attached_collector = basic_attached_collector<>;
+
+} // namespace counters
+#endif // COUNTERS_ATTACH_H_
@@ -1,8 +1,18 @@
 #ifndef COUNTERS_BENCH_H_
 #define COUNTERS_BENCH_H_
 #include "counters/event_counter.h"
+#include "counters/histogram.h"
+#include "counters/sample_arena.h"
+#include <chrono>
+#include <cmath>
 #include <stdexcept>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #if defined(__GNUC__) || defined(__clang__)
 #define COUNTERS_FLATTEN __attribute__((flatten, always_inline)) inline
@@ -51,177 +61,796 @@ struct bench_parameter {
   /// stable timing for very short functions. If you set this value too low,
   /// the timings might be unstable or wrong.
   size_t min_time_per_inner_ns = 30000;
+  /// Maximum number of calls in one sample (the inner repeat count M). M is
+  /// any count up to this value, chosen so that a sample takes about
+  /// `min_time_per_inner_ns`.
+  size_t inner_max_repeat = 10000;
+
+  /// Options for the event collector used by the benchmark, e.g.
+  /// ``collector.user_space_read = true`` to read the counters with `rdpmc`
+  /// on Linux, which reduces the per-sample overhead considerably.
+  collector_options collector{};
+
+  /// Number of empty regions measured to calibrate the overhead of the
+  /// collector (see basic_event_collector::calibrate). The calibration is
+  /// done once per collector configuration and stored in the result's
+  /// ``overhead``; 0 disables it.
+  size_t overhead_samples = 1000;
+
+  /// Subtract the calibrated overhead from every sample, so that the results
+  /// describe the benchmarked code alone. Useful for code that executes only
+  /// a few dozen instructions, where start()/end() are not negligible.
+  bool subtract_overhead = false;
+
+  /// Adaptive stopping: when positive, samples are taken until the
+  /// confidence interval of the median elapsed time is within this fraction
+  /// of the median (e.g. 0.005 for +/-0.5%), instead of a fixed count. The
+  /// warm-up is then `min_repeat` samples and `min_time_ns` is not used.
+  /// The result's `converged` flag tells whether the target was reached.
+  double target_precision = 0;
+  /// Confidence level of the interval used by adaptive stopping.
+  double confidence = 0.95;
+  /// Time budget of adaptive stopping, in nanoseconds: the measurement runs
+  /// for at least `adaptive_min_time_ns` and stops after
+  /// `adaptive_max_time_ns` (or `max_repeat` samples) even if the target
+  /// precision was not reached.
+  size_t adaptive_min_time_ns = 10'000'000;     // 10 ms
+  size_t adaptive_max_time_ns = 10'000'000'000; // 10 s
+
+  /// Warm up until the samples are stationary instead of for a fixed
+  /// `min_repeat` samples: after at least `min_repeat` samples, the warm-up
+  /// stops once a trend test (Mann-Kendall, 95%) on the last
+  /// `steady_state_window` samples finds no trend, which excludes effects
+  /// such as first-touch page faults, lazy initialization or frequency
+  /// ramps from the measurement. It gives up after `max_warmup_ns`. The
+  /// result reports `warmup_samples`, `warmup_ns` and `steady_state`.
+  bool steady_state_warmup = false;
+  size_t steady_state_window = 32;
+  size_t max_warmup_ns = 1'000'000'000; // 1 s
+
+  /// With bench_with_setup(): let a sample hold M calls, chosen like the
+  /// inner repeat count of bench(), with the setup preparing M inputs (one
+  /// per call) before the sample. Otherwise every sample is a single call
+  /// on a fresh input, which suits functions that take several
+  /// microseconds or more.
+  bool pregenerate_inputs = false;
+};
+
+/// Returns the calling thread's event collector for `Events...`,
+/// reconfigured with `options` if needed. Reusing the collector avoids
+/// reopening the counters on every call to bench().
+template <class... Events>
+basic_event_collector<Events...> &
+thread_collector(const collector_options &options) {
+  static thread_local basic_event_collector<Events...> collector(options);
+  collector.configure(options);
+  return collector;
+}
+
+/// Width of the unrolled blocks of call_ntimes and call_ntimes_runtime.
+constexpr size_t unroll_width = 10;
+
+namespace internal {
+template <typename Func, size_t... I>
+COUNTERS_FLATTEN void call_unrolled(Func &func, std::index_sequence<I...>) {
+  ((void(I), func()), ...);
+}
+
+// Stand-in for the benchmarked function that the compiler keeps, so that a
+// block of them costs what the inner loop itself costs.
+struct empty_call {
+  void operator()() const {
+#if defined(_MSC_VER) && !defined(__clang__)
+    _ReadWriteBarrier();
+#else
+    __asm__ volatile("");
+#endif
+  }
 };
+} // namespace internal
 
+/// Calls `func` M times: blocks of unroll_width calls unrolled at compile
+/// time, then the remaining M % unroll_width calls, also unrolled.
 template <std::size_t M, typename Func>
 COUNTERS_FLATTEN void call_ntimes(Func &&func) {
-  if constexpr (M == 1) {
-    func();
-    return;
+  if constexpr (M <= unroll_width) {
+    internal::call_unrolled(func, std::make_index_sequence<M>{});
+  } else {
+    for (size_t i = 0; i < M / unroll_width; ++i)
+      internal::call_unrolled(func, std::make_index_sequence<unroll_width>{});
+    internal::call_unrolled(func,
+                            std::make_index_sequence<M % unroll_width>{});
   }
-  if constexpr (M == 10) {
-    func();
-    func();
-    func();
-    func();
-    func();
-    func();
-    func();
-    func();
-    func();
+}
+
+/// Calls `func` M times, for any M chosen at run time: blocks of
+/// unroll_width calls unrolled at compile time, then a loop over the
+/// remaining M % unroll_width calls.
+template <typename Func>
+COUNTERS_FLATTEN void call_ntimes_runtime(Func &&func, size_t M) {
+  for (size_t i = M / unroll_width; i > 0; --i)
+    call_ntimes<unroll_width>(func);
+  for (size_t i = M % unroll_width; i > 0; --i)
     func();
-    return;
-  }
-  if constexpr (M == 100) {
-    for (size_t i = 0; i < 10; ++i)
-      call_ntimes<10>(func);
-    return;
-  }
-  if constexpr (M == 1000) {
-    for (size_t i = 0; i < 10; ++i)
-      call_ntimes<100>(func);
-    return;
-  }
-  if constexpr (M == 1000) {
-    for (size_t i = 0; i < 10; ++i)
-      call_ntimes<100>(func);
-    return;
-  }
-  if constexpr (M == 10000) {
-    for (size_t i = 0; i < 10; ++i)
-      call_ntimes<1000>(func);
-    return;
+}
+
+namespace internal {
+// A batch function f(size_t n) that runs its work n times itself, see
+// bench_batch().
+template <class Function> struct batch_call {
+  Function &function;
+};
+
+template <class T> struct is_batch_call : std::false_type {};
+template <class Function>
+struct is_batch_call<batch_call<Function>> : std::true_type {};
+
+// Runs one measured block of M calls: unrolled calls of `func`, or a single
+// call of a batch function.
+template <typename Func> COUNTERS_FLATTEN void run_block(Func &func, size_t M) {
+  call_ntimes_runtime(func, M);
+}
+template <typename Function>
+COUNTERS_FLATTEN void run_block(batch_call<Function> &batch, size_t M) {
+  batch.function(M);
+}
+
+// A benchmarked function(size_t i) with setup(size_t count) and teardown()
+// run around every sample, see bench_with_setup().
+template <class Setup, class Function, class Teardown> struct fixture_call {
+  Setup &setup;
+  Function &function;
+  Teardown &teardown;
+};
+
+template <class Setup, class Function, class Teardown>
+COUNTERS_FLATTEN void
+run_block(fixture_call<Setup, Function, Teardown> &fixture, size_t M) {
+  for (size_t i = 0; i < M; ++i)
+    fixture.function(i);
+}
+
+} // namespace internal
+
+/// Handle passed to the function benchmarked by bench_pausable(), to leave
+/// bookkeeping out of the measurement:
+///
+///   counters::bench_pausable([&](counters::bench_state &state) {
+///     process(buffer);
+///     state.pause();
+///     verify_checksum(buffer);
+///     state.resume();
+///   });
+///
+/// With other events than the default ones, take the state as `auto &`.
+template <class Collector> class basic_bench_state {
+public:
+  explicit basic_bench_state(Collector &c) : collector(c) {}
+
+  /// See basic_event_collector::pause(): every pause() must be followed by
+  /// resume() before the function returns.
+  void pause() {
+    collector.pause();
+    pauses++;
   }
-  throw std::runtime_error("Unsupported M in call_ntimes");
+  void resume() { collector.resume(); }
+  size_t pause_count() const { return pauses; }
+
+private:
+  Collector &collector;
+  size_t pauses = 0;
+};
+
+using bench_state = basic_bench_state<event_collector>;
+
+namespace internal {
+// A benchmarked function(state) that may pause the measurement, see
+// bench_pausable().
+template <class Function, class Collector> struct pausable_call {
+  Function &function;
+  basic_bench_state<Collector> state;
+  size_t calls = 0;
+};
+
+template <class Function, class Collector>
+COUNTERS_FLATTEN void run_block(pausable_call<Function, Collector> &pausable,
+                                size_t M) {
+  pausable.calls += M;
+  call_ntimes_runtime([&pausable] { pausable.function(pausable.state); }, M);
 }
 
-// Runtime dispatcher that maps some common repetition counts to
-// compile-time unrolled instantiations. Allowed compile-time sizes:
-// 1, 10, 100, 1000, 10000. Other values fall back to a simple loop.
-template <typename Func>
-inline void call_ntimes_runtime(Func &&func, size_t M) {
-  switch (M) {
-  case 1:
-    call_ntimes<1>(std::forward<Func>(func));
-    break;
-  case 10:
-    call_ntimes<10>(std::forward<Func>(func));
-    break;
-  case 100:
-    call_ntimes<100>(std::forward<Func>(func));
-    break;
-  case 1000:
-    call_ntimes<1000>(std::forward<Func>(func));
-    break;
-  case 10000:
-    call_ntimes<1000>(std::forward<Func>(func));
-    break;
-  default:
-    throw std::runtime_error("Unsupported M in call_ntimes_runtime");
-    break;
-  }
-}
-
-template <size_t M, class Function>
-size_t bench_compute_repeat_impl(Function &&function, event_collector& collector,
-                                            size_t min_repeat,
+// Run before collector.start() and after collector.end() for each sample.
+template <typename Func> void setup_block(Func &, size_t) {}
+template <typename Func> void teardown_block(Func &) {}
+template <class Setup, class Function, class Teardown>
+void setup_block(fixture_call<Setup, Function, Teardown> &fixture, size_t M) {
+  fixture.setup(M);
+}
+template <class Setup, class Function, class Teardown>
+void teardown_block(fixture_call<Setup, Function, Teardown> &fixture) {
+  fixture.teardown();
+}
+
+// Whether a sample may hold more than one call: with a setup, only if it
+// prepares one input per call (bench_parameter::pregenerate_inputs).
+template <typename Func> bool repeats_inner(Func &, const bench_parameter &) {
+  return true;
+}
+template <class Setup, class Function, class Teardown>
+bool repeats_inner(fixture_call<Setup, Function, Teardown> &,
+                   const bench_parameter &params) {
+  return params.pregenerate_inputs;
+}
+} // namespace internal
+
+// What the warm-up did, reported in the aggregate.
+struct warmup_report {
+  size_t samples = 0;
+  double elapsed_ns = 0;
+  bool steady_state = false;
+};
+
+template <class Collector, class Function>
+size_t bench_compute_repeat_impl(Function &&function, Collector &collector,
+                                            size_t M, size_t min_repeat,
                                             size_t min_time_ns,
-                                            size_t max_repeat) {
-  auto fn = std::forward<Function>(function);
+                                            size_t max_repeat,
+                                            warmup_report *report = nullptr) {
+  const auto start = std::chrono::steady_clock::now();
   size_t N = min_repeat;
   if (N == 0) {
     N = 1;
   }
   // Warm-up
-  event_aggregate warm_aggregate{};
+  typename Collector::aggregate_type warm_aggregate{};
   for (size_t i = 0; i < N; i++) {
+    internal::setup_block(function, M);
     collector.start();
-    call_ntimes<M>(std::forward<Function>(function));
-    event_count allocate_count = collector.end();
+    internal::run_block(function, M);
+    const auto &allocate_count = collector.end();
+    internal::teardown_block(function);
     warm_aggregate << allocate_count;
     if ((i + 1 == N) && (warm_aggregate.total_elapsed_ns() < min_time_ns) &&
         (N < max_repeat)) {
-      N *= 10;
+      N = N * 10 < max_repeat ? N * 10 : max_repeat;
     }
   }
+  if (report != nullptr) {
+    report->samples = N;
+    report->elapsed_ns = std::chrono::duration<double, std::nano>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  }
   return N;
 }
 
-// Compile-time specialized bench implementation for a fixed inner repeat M.
-template <size_t M, class Function>
-event_aggregate bench_impl(Function &&function, size_t min_repeat,
-                           size_t min_time_ns, size_t max_repeat) {
-  static thread_local event_collector collector;
-  // Let us determine the outer repeat count N first.
-  size_t N =
-      bench_compute_repeat_impl<M>(std::forward<Function>(function), collector,
-                                   min_repeat, min_time_ns, max_repeat);
-  // Measurement
-  event_aggregate aggregate{};
+// Warms up until the last params.steady_state_window samples show no trend
+// (see bench_parameter::steady_state_warmup), then picks N like
+// bench_compute_repeat_impl from the mean sample time.
+template <class Collector, class Function>
+size_t bench_steady_state_impl(Function &&function, Collector &collector,
+                               size_t M, const bench_parameter &params,
+                               warmup_report &report) {
+  const auto start = std::chrono::steady_clock::now();
+  const size_t window =
+      params.steady_state_window < 3 ? 3 : params.steady_state_window;
+  const size_t min_samples =
+      params.min_repeat > window ? params.min_repeat : window;
+  const size_t check_every = window / 4 == 0 ? 1 : window / 4;
+  std::vector<double> recent(window), ordered(window);
+  double total_ns = 0;
+  size_t samples = 0;
+  while (true) {
+    internal::setup_block(function, M);
+    collector.start();
+    internal::run_block(function, M);
+    const double ns = collector.end().elapsed_ns();
+    internal::teardown_block(function);
+    recent[samples % window] = ns;
+    total_ns += ns;
+    samples++;
+    if (samples >= min_samples && samples % check_every == 0) {
+      for (size_t i = 0; i < window; i++) {
+        ordered[i] = recent[(samples + i) % window];
+      }
+      if (std::fabs(trend_z_score(ordered.data(), window)) < 1.96) {
+        report.steady_state = true;
+        break;
+      }
+    }
+    const double wall_ns = std::chrono::duration<double, std::nano>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    if (wall_ns >= double(params.max_warmup_ns) ||
+        samples >= params.max_repeat) {
+      break;
+    }
+  }
+  report.samples = samples;
+  report.elapsed_ns = std::chrono::duration<double, std::nano>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+  size_t N = params.min_repeat == 0 ? 1 : params.min_repeat;
+  if (total_ns / double(samples) * double(N) < double(params.min_time_ns) &&
+      N < params.max_repeat) {
+    N = N * 10 < params.max_repeat ? N * 10 : params.max_repeat;
+  }
+  return N;
+}
+
+// The sample arena matching a collector.
+template <class Collector>
+using arena_for = basic_sample_arena<typename Collector::event_set_type>;
+
+// Runs N measured samples of M calls each, storing them in `arena` (if not
+// null) as pass `pass`.
+template <class Collector, class Function>
+typename Collector::aggregate_type
+bench_measure_impl(Function &&function, Collector &collector, size_t M,
+                   size_t N,
+                   arena_for<Collector> *arena = nullptr, size_t pass = 0) {
+  typename Collector::aggregate_type aggregate{};
   for (size_t i = 0; i < N; i++) {
+    internal::setup_block(function, M);
     collector.start();
-    call_ntimes<M>(std::forward<Function>(function));
-    event_count allocate_count = collector.end();
+    internal::run_block(function, M);
+    const auto &allocate_count = collector.end();
+    internal::teardown_block(function);
     aggregate << allocate_count;
+    if (collector.options.inherit) {
+      aggregate.add_calling_thread(collector.calling_thread_count());
+    }
+    if (arena != nullptr) {
+      arena->record(allocate_count, pass, i);
+    }
   }
   aggregate.inner_count = M;
+  if (arena != nullptr) {
+    arena->set_inner_count(M);
+  }
   return aggregate;
 }
 
-template <class Function>
-event_aggregate bench(Function &&function, size_t min_repeat = 10,
-                      size_t min_time_ns = 400'000'000,
-                      size_t max_repeat = 1000000,
-                      size_t min_time_per_inner_ns = 30000) {
-  static thread_local event_collector collector;
-  auto fn = std::forward<Function>(function);
-  size_t N = min_repeat;
-  constexpr size_t max_inner_M = 10000;
-  // if function() is too fast, repeat it M times to get a measurable time.
-  size_t M = 1;
-  call_ntimes_runtime(fn, M); // call it once to warm up any caches, etc.
-  while (M < max_inner_M) {
+// Runs N samples of M calls that are not recorded.
+template <class Collector, class Function>
+void bench_warmup_impl(Function &function, Collector &collector, size_t M,
+                       size_t N) {
+  for (size_t i = 0; i < N; i++) {
+    internal::setup_block(function, M);
     collector.start();
-    call_ntimes_runtime(fn, M);
-    event_count allocate_count = collector.end();
-    if (allocate_count.elapsed_ns() >= min_time_per_inner_ns) {
+    internal::run_block(function, M);
+    collector.end();
+    internal::teardown_block(function);
+  }
+}
+
+// Measures samples of M calls until the confidence interval of the median
+// elapsed time is within params.target_precision of the median, or until the
+// adaptive time budget or max_repeat runs out. The interval is checked after
+// every eighth or so of the samples taken so far.
+template <class Collector, class Function>
+typename Collector::aggregate_type
+bench_measure_adaptive_impl(Function &&function, Collector &collector,
+                            size_t M, const bench_parameter &params,
+                            arena_for<Collector> *arena) {
+  typename Collector::aggregate_type aggregate{};
+  const auto start = std::chrono::steady_clock::now();
+  const double z = normal_quantile(0.5 + params.confidence / 2);
+  size_t next_check = params.min_repeat < 2 ? 2 : params.min_repeat;
+  for (size_t i = 0; i < params.max_repeat; i++) {
+    internal::setup_block(function, M);
+    collector.start();
+    internal::run_block(function, M);
+    const auto &allocate_count = collector.end();
+    internal::teardown_block(function);
+    aggregate << allocate_count;
+    if (collector.options.inherit) {
+      aggregate.add_calling_thread(collector.calling_thread_count());
+    }
+    if (arena != nullptr) {
+      arena->record(allocate_count, 0, i);
+    }
+    if (i + 1 < next_check) {
+      continue;
+    }
+    next_check = i + 1 + (i + 1) / 8;
+    const double elapsed_ns =
+        std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start)
+            .count();
+    if (elapsed_ns >= double(params.adaptive_max_time_ns)) {
       break;
     }
-    M *= 10;
-    if (M >= max_inner_M) {
-      M = max_inner_M;
+    if (elapsed_ns < double(params.adaptive_min_time_ns)) {
+      continue;
+    }
+    double low, high;
+    aggregate.elapsed_statistics.quantiles.median_interval(
+        z, aggregate.elapsed_statistics.moments.count(), low, high);
+    const double median = aggregate.elapsed_statistics.quantiles.median();
+    if (median > 0 && (high - low) / 2 <= params.target_precision * median) {
+      aggregate.converged = true;
       break;
     }
   }
+  aggregate.inner_count = M;
+  if (arena != nullptr) {
+    arena->set_inner_count(M);
+  }
+  return aggregate;
+}
+
+// Warms up, then measures samples of M calls each.
+template <class Collector, class Function>
+typename Collector::aggregate_type
+bench_impl(Function &&function, Collector &collector, size_t M,
+           const bench_parameter &params, arena_for<Collector> *arena) {
+  const size_t min_repeat = params.min_repeat;
+  const bool adaptive = params.target_precision > 0;
+  // Let us determine the outer repeat count N first. With adaptive
+  // stopping, the warm-up is min_repeat samples and N follows from the
+  // measurement.
+  warmup_report warmup;
+  size_t N =
+      params.steady_state_warmup
+          ? bench_steady_state_impl(std::forward<Function>(function),
+                                    collector, M, params, warmup)
+          : bench_compute_repeat_impl(
+                std::forward<Function>(function), collector, M, min_repeat,
+                adaptive ? 0 : params.min_time_ns, params.max_repeat, &warmup);
+  // With min_repeat above max_repeat, N exceeds the arena's reservation;
+  // it grows here, before the measured samples, so that none is dropped.
+  if (arena != nullptr && !adaptive && N > arena->capacity()) {
+    arena->reserve(N, arena->counters());
+  }
+  // Measurement
+  auto aggregate =
+      adaptive ? bench_measure_adaptive_impl(std::forward<Function>(function),
+                                             collector, M, params, arena)
+               : bench_measure_impl(std::forward<Function>(function),
+                                    collector, M, N, arena);
+  N = size_t(aggregate.iterations);
+  aggregate.warmup_samples = warmup.samples;
+  aggregate.warmup_ns = warmup.elapsed_ns;
+  aggregate.steady_state = warmup.steady_state;
+  // With event_scheduling::multi_pass, every other event group gets its own
+  // pass with the same M and N, after a short warm-up.
+  const size_t passes = collector.pass_count();
+  for (size_t pass = 1; pass < passes; pass++) {
+    collector.select_pass(pass);
+    bench_warmup_impl(function, collector, M, min_repeat);
+    aggregate.combine_pass(bench_measure_impl(
+        std::forward<Function>(function), collector, M, N, arena, pass));
+  }
+  collector.select_pass(0);
+  return aggregate;
+}
+
+// Picks the inner repeat count M so that a sample of M calls takes about
+// params.min_time_per_inner_ns: M grows tenfold until the fastest of three
+// samples takes at least a tenth of the target, then is scaled to the
+// target, up to params.inner_max_repeat.
+template <class Collector, class Function>
+size_t bench_inner_repeat_impl(Function &function, Collector &collector,
+                               const bench_parameter &params) {
+  const double target_ns = double(params.min_time_per_inner_ns);
+  const size_t max_M = params.inner_max_repeat == 0 ? 1 : params.inner_max_repeat;
+  // call it once to warm up any caches, etc.
+  internal::setup_block(function, 1);
+  internal::run_block(function, 1);
+  internal::teardown_block(function);
+  if (!internal::repeats_inner(function, params)) {
+    return 1;
+  }
+  size_t M = 1;
+  while (true) {
+    double ns = 0;
+    for (int i = 0; i < 3; i++) {
+      internal::setup_block(function, M);
+      collector.start();
+      internal::run_block(function, M);
+      const double sample_ns = collector.end().elapsed_ns();
+      internal::teardown_block(function);
+      if (i == 0 || sample_ns < ns) {
+        ns = sample_ns;
+      }
+    }
+    if (ns > 0 && (ns * 10 >= target_ns || M == max_M)) {
+      const double exact = std::ceil(double(M) * target_ns / ns);
+      return exact < 1 ? 1 : exact > double(max_M) ? max_M : size_t(exact);
+    }
+    if (M == max_M) {
+      return M;
+    }
+    M = M > max_M / 10 ? max_M : M * 10;
+  }
+}
+
+// Elapsed nanoseconds of a sample of M calls to an empty function, beyond
+// the cost of the empty region `region_ns`: the cost of the inner loop.
+template <class Collector>
+double bench_loop_overhead_impl(Collector &collector, size_t M,
+                                size_t samples, double region_ns) {
+  internal::empty_call empty;
+  quantile_sketch blocks;
+  for (size_t i = 0; i < samples; i++) {
+    collector.start();
+    call_ntimes_runtime(empty, M);
+    blocks.update(collector.end().elapsed_ns());
+  }
+  const double loop_ns = blocks.median() - region_ns;
+  return loop_ns > 0 ? loop_ns : 0;
+}
+
+// Picks the inner repeat count M, then runs the measurement with `collector`.
+template <class Collector, class Function>
+typename Collector::aggregate_type
+bench_run_impl(Function &&function, Collector &collector,
+               const bench_parameter &params,
+               arena_for<Collector> *arena = nullptr) {
+  if (arena != nullptr) {
+    arena->reserve(params.max_repeat, arena->counters());
+  }
+  // if function() is too fast, repeat it M times to get a measurable time.
+  const size_t M = bench_inner_repeat_impl(function, collector, params);
+  typename Collector::aggregate_type aggregate =
+      bench_impl(std::forward<Function>(function), collector, M, params,
+                 arena);
+  aggregate.overhead = collector.calibrate(params.overhead_samples);
+  // A batch function runs its own loop, whose cost is part of its work.
+  if (params.overhead_samples > 0 &&
+      !internal::is_batch_call<std::decay_t<Function>>::value) {
+    aggregate.loop_overhead_ns = bench_loop_overhead_impl(
+        collector, M, params.overhead_samples / 10 + 1,
+        aggregate.overhead.elapsed_ns());
+  }
+  if (params.subtract_overhead) {
+    aggregate.subtract_overhead(aggregate.overhead);
+  }
+  return aggregate;
+}
+
+/// Benchmarks `function`, counting the events `Events...` (default:
+/// default_event_set), e.g.
+///
+///   auto agg = counters::bench<counters::events::cycles,
+///                              counters::events::l1d_misses>(f, params);
+///   double misses = agg.get<counters::events::l1d_misses>();
+template <class... Events, class Function>
+basic_event_aggregate<event_set_t<Events...>>
+bench(Function &&function, const bench_parameter &params) {
+  auto &collector = thread_collector<Events...>(params.collector);
+  return bench_run_impl(std::forward<Function>(function), collector, params);
+}
+
+/// Same, also storing every sample in `arena` (see basic_sample_arena),
+/// which is cleared first and grown to `params.max_repeat` samples (or
+/// `params.min_repeat`, if larger) if needed, before any measured sample.
+template <class... Events, class Function>
+basic_event_aggregate<event_set_t<Events...>>
+bench(Function &&function, const bench_parameter &params,
+      basic_sample_arena<event_set_t<Events...>> &arena) {
+  auto &collector = thread_collector<Events...>(params.collector);
+  return bench_run_impl(std::forward<Function>(function), collector, params,
+                        &arena);
+}
+
+/// Benchmarks a batch function `function(size_t n)` that runs its work `n`
+/// times itself, e.g. a kernel over `n` elements:
+///
+///   auto agg = counters::bench_batch([&](size_t n) {
+///     process(input.data(), n);
+///   });
+///
+/// Each sample is a single call `function(n)`, with `n` chosen like the
+/// inner repeat count of bench() (`min_time_per_inner_ns`,
+/// `inner_max_repeat`), so the measured loop is the function's own rather
+/// than calls unrolled around it. The results are per unit of work:
+/// divided by `n`, which is `inner_iteration_count()`.
+template <class... Events, class Function>
+basic_event_aggregate<event_set_t<Events...>>
+bench_batch(Function &&function,
+            const bench_parameter &params = bench_parameter()) {
+  auto &collector = thread_collector<Events...>(params.collector);
+  internal::batch_call<std::remove_reference_t<Function>> batch{function};
+  return bench_run_impl(batch, collector, params);
+}
+
+/// Benchmarks `function(size_t i)`, which may modify its input (in-place
+/// sort, hash-table insertion, decompression into a buffer), with a fresh
+/// input for every call:
+///
+///   std::vector<std::vector<int>> inputs;
+///   auto agg = counters::bench_with_setup(
+///       [&](size_t count) { inputs.assign(count, unsorted); },
+///       [&](size_t i) { std::sort(inputs[i].begin(), inputs[i].end()); },
+///       [] {});
+///
+/// Before every sample `setup(count)` prepares the inputs of the `count`
+/// calls of that sample, and `teardown()` runs after it. Both run outside
+/// the measured region, so they count neither in the time nor in the
+/// events. `count` is 1 unless `params.pregenerate_inputs` is set.
+template <class... Events, class Setup, class Function, class Teardown>
+basic_event_aggregate<event_set_t<Events...>>
+bench_with_setup(Setup &&setup, Function &&function, Teardown &&teardown,
+                 const bench_parameter &params = bench_parameter()) {
+  auto &collector = thread_collector<Events...>(params.collector);
+  internal::fixture_call<std::remove_reference_t<Setup>,
+                         std::remove_reference_t<Function>,
+                         std::remove_reference_t<Teardown>>
+      fixture{setup, function, teardown};
+  return bench_run_impl(fixture, collector, params);
+}
 
-  // Dispatch to compile-time specialized implementation for common M values.
-  switch (M) {
-  case 1:
-    return bench_impl<1>(std::forward<Function>(function), min_repeat,
-                         min_time_ns, max_repeat);
-  case 10:
-    return bench_impl<10>(std::forward<Function>(function), min_repeat,
-                          min_time_ns, max_repeat);
-  case 100:
-    return bench_impl<100>(std::forward<Function>(function), min_repeat,
-                           min_time_ns, max_repeat);
-  case 1000:
-    return bench_impl<1000>(std::forward<Function>(function), min_repeat,
-                            min_time_ns, max_repeat);
-  case 10000:
-    return bench_impl<10000>(std::forward<Function>(function), min_repeat,
-                             min_time_ns, max_repeat);
-  default:
-    // Fallback to generic runtime implementation
-    throw std::runtime_error("unreachable");
-    break;
+/// Benchmarks `function(state)`, which may call `state.pause()` and
+/// `state.resume()` (see basic_bench_state) to leave parts of its work out
+/// of the time and of the events. Pausing has a cost, reported in the
+/// result: `overhead.pause` per pause()/resume() pair and `pauses_per_call`.
+/// Part of it falls inside the measurement, so pausing around less work
+/// than a pair costs, e.g. in an inner loop, does more harm than good.
+template <class... Events, class Function>
+basic_event_aggregate<event_set_t<Events...>>
+bench_pausable(Function &&function,
+               const bench_parameter &params = bench_parameter()) {
+  using collector_type = basic_event_collector<Events...>;
+  auto &collector = thread_collector<Events...>(params.collector);
+  internal::pausable_call<std::remove_reference_t<Function>, collector_type>
+      pausable{function, basic_bench_state<collector_type>(collector)};
+  auto aggregate = bench_run_impl(pausable, collector, params);
+  aggregate.overhead = collector.calibrate_pause(params.overhead_samples);
+  if (pausable.calls > 0) {
+    aggregate.pauses_per_call =
+        double(pausable.state.pause_count()) / double(pausable.calls);
   }
+  return aggregate;
+}
+
+#if defined(__linux__)
+/// Benchmarks `function`, counting the events of a runtime `events` list
+/// (see event_list in event_spec.h). Counter `i` of the result corresponds
+/// to `events.name(i)`. `Capacity` bounds the number of events.
+template <size_t Capacity = 32, class Function>
+basic_event_aggregate<runtime_event_set<Capacity>>
+bench(const event_list &events, Function &&function,
+      const bench_parameter &params = bench_parameter()) {
+  auto &collector =
+      thread_collector<runtime_event_set<Capacity>>(params.collector);
+  collector.configure(events, params.collector);
+  return bench_run_impl(std::forward<Function>(function), collector, params);
 }
 
+/// Same, also storing every sample of the `events.size()` events in `arena`.
+template <size_t Capacity = 32, class Function>
+basic_event_aggregate<runtime_event_set<Capacity>>
+bench(const event_list &events, Function &&function,
+      const bench_parameter &params,
+      basic_sample_arena<runtime_event_set<Capacity>> &arena) {
+  auto &collector =
+      thread_collector<runtime_event_set<Capacity>>(params.collector);
+  collector.configure(events, params.collector);
+  arena.reserve(params.max_repeat, events.size());
+  return bench_run_impl(std::forward<Function>(function), collector, params,
+                        &arena);
+}
+#endif
+
+/// Per-call latencies measured by bench_latency(), in timer ticks.
+struct latency_result {
+  latency_histogram histogram{};
+  /// Duration of one tick: 1 with steady_clock, less with the cycle counter.
+  double ns_per_tick = 1;
+  /// Median cost of the two timestamps around each call, in ticks. It was
+  /// subtracted from every call when bench_parameter::subtract_overhead is
+  /// set.
+  uint64_t timer_overhead = 0;
+  bool overhead_subtracted = false;
+  /// Whether the calls were timed with the cycle counter (rdtsc, cntvct_el0)
+  /// rather than steady_clock.
+  bool cycle_counter = false;
+
+  uint64_t calls() const { return histogram.count(); }
+  double percentile_ns(double p) const {
+    return double(histogram.percentile(p)) * ns_per_tick;
+  }
+  double p50_ns() const { return percentile_ns(50); }
+  double p90_ns() const { return percentile_ns(90); }
+  double p99_ns() const { return percentile_ns(99); }
+  double p999_ns() const { return percentile_ns(99.9); }
+  double min_ns() const { return double(histogram.min()) * ns_per_tick; }
+  double max_ns() const { return double(histogram.max()) * ns_per_tick; }
+  double mean_ns() const { return histogram.mean() * ns_per_tick; }
+  double timer_overhead_ns() const { return double(timer_overhead) * ns_per_tick; }
+};
+
+namespace internal {
+// Timestamps for bench_latency(): the cycle counter when it is usable,
+// steady_clock nanoseconds otherwise, with the fences of `fence`.
+struct latency_timer {
+  bool cycle_counter = cycle_counter_available();
+  measurement_fence fence_kind = measurement_fence::none;
+
+  uint64_t start() const {
+    counters::fence(fence_kind);
+    const uint64_t ticks = cycle_counter ? read_cycle_counter() : steady_ns();
+    counters::fence(fence_kind);
+    return ticks;
+  }
+  uint64_t end() const {
+    counters::fence(fence_kind);
+    const uint64_t ticks =
+        cycle_counter ? read_cycle_counter_end() : steady_ns();
+    counters::fence(fence_kind);
+    return ticks;
+  }
+  static uint64_t steady_ns() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch())
+                        .count());
+  }
+};
+} // namespace internal
+
+/// Times every call of `function` individually and records the latencies in
+/// a histogram, so that the tail (p99, p99.9, max) is visible:
+///
+///   auto latency = counters::bench_latency([] { /* ... */ });
+///   printf("p50 %.0f ns, p99 %.0f ns\n", latency.p50_ns(), latency.p99_ns());
+///
+/// After `params.min_repeat` warm-up calls, calls are recorded until both
+/// `params.min_repeat` calls and `params.min_time_ns` have been reached, or
+/// `params.max_repeat` calls. The fence of `params.collector` applies; the
+/// performance counters are not read. Memory use does not depend on the
+/// number of calls.
 template <class Function>
-event_aggregate bench(Function &&function, const bench_parameter &params) {
-  return bench(std::forward<Function>(function), params.min_repeat,
-               params.min_time_ns, params.max_repeat, params.min_time_per_inner_ns);
+latency_result bench_latency(Function &&function,
+                             const bench_parameter &params = bench_parameter()) {
+  latency_result result;
+  internal::latency_timer timer;
+  timer.fence_kind = params.collector.fence;
+  result.cycle_counter = timer.cycle_counter;
+  result.ns_per_tick = timer.cycle_counter ? 1e9 / cycle_counter_frequency() : 1;
+  if (params.overhead_samples > 0) {
+    latency_histogram empty;
+    for (size_t i = 0; i < params.overhead_samples; i++) {
+      const uint64_t start = timer.start();
+      const uint64_t end = timer.end();
+      empty.record(end > start ? end - start : 0);
+    }
+    result.timer_overhead = empty.percentile(50);
+  }
+  const uint64_t overhead = params.subtract_overhead ? result.timer_overhead : 0;
+  result.overhead_subtracted = params.subtract_overhead;
+  for (size_t i = 0; i < params.min_repeat; i++) {
+    function();
+  }
+  const double min_ticks = double(params.min_time_ns) / result.ns_per_tick;
+  const uint64_t first = timer.start();
+  for (size_t calls = 1; calls <= params.max_repeat; calls++) {
+    const uint64_t start = timer.start();
+    function();
+    const uint64_t end = timer.end();
+    const uint64_t ticks = end > start ? end - start : 0;
+    result.histogram.record(ticks > overhead ? ticks - overhead : 0);
+    if (calls >= params.min_repeat && (calls & 255) == 0 &&
+        double(end - first) >= min_ticks) {
+      break;
+    }
+  }
+  return result;
+}
+
+template <class... Events, class Function>
+basic_event_aggregate<event_set_t<Events...>>
+bench(Function &&function, size_t min_repeat = 10,
+                      size_t min_time_ns = 400'000'000,
+                      size_t max_repeat = 1000000,
+                      size_t min_time_per_inner_ns = 30000) {
+  bench_parameter params;
+  params.min_repeat = min_repeat;
+  params.min_time_ns = min_time_ns;
+  params.max_repeat = max_repeat;
+  params.min_time_per_inner_ns = min_time_per_inner_ns;
+  return bench<Events...>(std::forward<Function>(function), params);
 }
 
 } // namespace counters
@@ -9,10 +9,21 @@
 
 #include <cstring>
 
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <numeric>
+#include <stdexcept>
 #include <chrono>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "events.h"
+#include "statistics.h"
+#include "timers.h"
 #include "linux-perf-events.h"
+#include "event_spec.h"
 #ifdef __linux__
 #include <libgen.h>
 #endif
@@ -22,17 +33,29 @@
 #endif
 
 namespace counters {
-struct event_count {
+/// Measurement for one code region: elapsed time plus one count per event of
+/// `Set` (an event_set, see events.h). The counters are stored inline so that
+/// taking, copying and accumulating samples never touches the heap.
+template <class Set> struct basic_event_count {
+  using event_set_type = Set;
+  static constexpr size_t event_capacity = Set::size;
   std::chrono::duration<double> elapsed;
-  std::vector<unsigned long long> event_counts;
-  event_count() : elapsed(0), event_counts{0, 0, 0, 0, 0} {}
-  event_count(const std::chrono::duration<double> _elapsed,
-              const std::vector<unsigned long long> _event_counts)
-      : elapsed(_elapsed), event_counts(_event_counts) {}
-  event_count(const event_count &other)
-      : elapsed(other.elapsed), event_counts(other.event_counts) {}
-
-  // The types of counters (so we can read the getter more easily)
+  std::array<unsigned long long, Set::size> event_counts;
+  // Fraction of the measurement during which each event was counting: 1 for
+  // exact counts, less than 1 for counts scaled up after multiplexing, 0 for
+  // events that were never counted. A sum keeps the smallest coverage.
+  std::array<float, Set::size> coverage;
+  basic_event_count() : elapsed(0), event_counts{} { coverage.fill(1); }
+  basic_event_count(
+      const std::chrono::duration<double> _elapsed,
+      const std::array<unsigned long long, Set::size> &_event_counts)
+      : elapsed(_elapsed), event_counts(_event_counts) {
+    coverage.fill(1);
+  }
+  basic_event_count(const basic_event_count &other) = default;
+
+  // The types of counters (so we can read the getter more easily). These
+  // indexes are only meaningful for the default event set.
   enum event_counter_types {
     CPU_CYCLES,
     INSTRUCTIONS,
@@ -47,47 +70,183 @@ struct event_count {
   double elapsed_ns() const {
     return std::chrono::duration<double, std::nano>(elapsed).count();
   }
-  double cycles() const {
-    return static_cast<double>(event_counts[CPU_CYCLES]);
+  // Count of event `E`, which must be part of `Set`.
+  template <class E> double get() const {
+    static_assert(Set::template contains<E>(), "event not in the event set");
+    return static_cast<double>(event_counts[Set::template index_of<E>()]);
   }
-  double instructions() const {
-    return static_cast<double>(event_counts[INSTRUCTIONS]);
+  // Count of the `i`-th event of the set.
+  double get(size_t i) const { return static_cast<double>(event_counts[i]); }
+  count_confidence confidence(size_t i) const {
+    return coverage[i] >= 1   ? count_confidence::exact
+           : coverage[i] <= 0 ? count_confidence::missing
+                              : count_confidence::scaled;
   }
-  double branch_misses() const {
-    return static_cast<double>(event_counts[BRANCH_MISSES]);
+  template <class E> count_confidence confidence() const {
+    static_assert(Set::template contains<E>(), "event not in the event set");
+    return confidence(Set::template index_of<E>());
   }
-  double branches() const { return static_cast<double>(event_counts[BRANCH]); }
-  double cache_misses() const {
-    return static_cast<double>(event_counts[CACHE_MISSES]);
+  // The named getters return 0 when the event is not part of `Set`.
+  double cycles() const { return get_or_zero<events::cycles>(); }
+  double instructions() const { return get_or_zero<events::instructions>(); }
+  double branch_misses() const { return get_or_zero<events::branch_misses>(); }
+  double branches() const { return get_or_zero<events::branches>(); }
+  double cache_misses() const { return get_or_zero<events::cache_misses>(); }
+
+  basic_event_count &operator=(const basic_event_count &other) = default;
+  basic_event_count operator+(const basic_event_count &other) const {
+    basic_event_count result(*this);
+    result += other;
+    return result;
   }
 
-  event_count &operator=(const event_count &other) {
-    this->elapsed = other.elapsed;
-    this->event_counts = other.event_counts;
-    return *this;
+  void operator+=(const basic_event_count &other) {
+    elapsed += other.elapsed;
+    for (size_t i = 0; i < Set::size; i++) {
+      event_counts[i] += other.event_counts[i];
+      if (other.coverage[i] < coverage[i]) {
+        coverage[i] = other.coverage[i];
+      }
+    }
+  }
+
+private:
+  template <class E> double get_or_zero() const {
+    if constexpr (Set::template contains<E>()) {
+      return get<E>();
+    } else {
+      return 0;
+    }
+  }
+};
+
+/// Cost of measuring an empty region with a collector: what start() and
+/// end() themselves add to every sample. Each counter (and the elapsed time)
+/// is summarized independently over the calibration samples.
+template <class Set> struct basic_event_overhead {
+  size_t samples = 0;
+  basic_event_count<Set> minimum{};
+  basic_event_count<Set> median{};
+  basic_event_count<Set> maximum{};
+  // Part of the median due to the measurement fences, if any (see
+  // collector_options::fence).
+  basic_event_count<Set> fence{};
+  // Cost of one pause()/resume() pair inside a region, once calibrated (see
+  // basic_event_collector::calibrate_pause).
+  basic_event_count<Set> pause{};
+  size_t pause_samples = 0;
+
+  double elapsed_ns() const { return median.elapsed_ns(); }
+  double get(size_t i) const { return median.get(i); }
+  template <class E> double get() const { return median.template get<E>(); }
+
+  // Sets `fence` to what the median exceeds `unfenced` by, which was
+  // calibrated the same way without fences.
+  void set_fence_cost(const basic_event_overhead &unfenced) {
+    fence = excess(median, unfenced.median);
   }
-  event_count operator+(const event_count &other) const {
-    return event_count(elapsed + other.elapsed,
-                       {
-                           event_counts[0] + other.event_counts[0],
-                           event_counts[1] + other.event_counts[1],
-                           event_counts[2] + other.event_counts[2],
-                           event_counts[3] + other.event_counts[3],
-                           event_counts[4] + other.event_counts[4],
-                       });
+
+  // Sets `pause` to what the median of `paused`, calibrated with a
+  // pause()/resume() pair in every region, exceeds the median by.
+  void set_pause_cost(const basic_event_overhead &paused) {
+    pause = excess(paused.median, median);
+    pause_samples = paused.samples;
   }
 
-  void operator+=(const event_count &other) { *this = *this + other; }
+  // Summarizes the counters that `measured` counted (coverage above zero),
+  // plus the elapsed time when `with_elapsed` is set. With multi-pass
+  // scheduling, every pass contributes its own events.
+  void add_pass(std::vector<basic_event_count<Set>> &measured,
+                bool with_elapsed) {
+    if (measured.empty()) {
+      return;
+    }
+    samples = measured.size();
+    const size_t middle = measured.size() / 2;
+    if (with_elapsed) {
+      std::sort(measured.begin(), measured.end(),
+                [](const basic_event_count<Set> &a,
+                   const basic_event_count<Set> &b) {
+                  return a.elapsed < b.elapsed;
+                });
+      minimum.elapsed = measured.front().elapsed;
+      median.elapsed = measured[middle].elapsed;
+      maximum.elapsed = measured.back().elapsed;
+    }
+    for (size_t i = 0; i < Set::size; i++) {
+      if (measured.front().coverage[i] <= 0) {
+        continue;
+      }
+      std::sort(measured.begin(), measured.end(),
+                [i](const basic_event_count<Set> &a,
+                    const basic_event_count<Set> &b) {
+                  return a.event_counts[i] < b.event_counts[i];
+                });
+      minimum.event_counts[i] = measured.front().event_counts[i];
+      median.event_counts[i] = measured[middle].event_counts[i];
+      maximum.event_counts[i] = measured.back().event_counts[i];
+    }
+  }
+
+private:
+  // What `with` exceeds `without` by, per counter, clamped at zero.
+  static basic_event_count<Set> excess(const basic_event_count<Set> &with,
+                                       const basic_event_count<Set> &without) {
+    basic_event_count<Set> result;
+    result.elapsed = with.elapsed > without.elapsed
+                         ? with.elapsed - without.elapsed
+                         : std::chrono::duration<double>(0);
+    for (size_t i = 0; i < Set::size; i++) {
+      result.event_counts[i] = with.event_counts[i] > without.event_counts[i]
+                                   ? with.event_counts[i] - without.event_counts[i]
+                                   : 0;
+    }
+    return result;
+  }
 };
 
-struct event_aggregate {
+template <class Set> struct basic_event_aggregate {
+  using event_set_type = Set;
   bool has_events = false;
   int iterations = 0;
   int inner_count = 1; // Number of inner iterations
-  event_count total{};
-  event_count best{};
-  event_count worst{};
-  template <typename T> event_aggregate &operator/=(T divisor) {
+  basic_event_count<Set> total{};
+  basic_event_count<Set> best{};
+  basic_event_count<Set> worst{};
+  // Largest per-sample coverage of each event; the smallest is in
+  // total.coverage.
+  std::array<float, Set::size> max_coverage{};
+  // Cost of the measurement itself, per sample (see
+  // basic_event_collector::calibrate), and whether it was subtracted.
+  basic_event_overhead<Set> overhead{};
+  bool overhead_subtracted = false;
+  // Average number of pause() calls per call of the function benchmarked by
+  // bench_pausable(); each costs about overhead.pause.
+  double pauses_per_call = 0;
+  // Median cost of bench()'s inner loop of inner_count empty calls, per
+  // sample, beyond the overhead above. Reported, never subtracted.
+  double loop_overhead_ns = 0;
+  // Streaming statistics of the samples (elapsed nanoseconds and counts per
+  // sample), updated by operator<<. Counters are only updated by samples in
+  // which they were counted.
+  counter_statistics elapsed_statistics{};
+  std::array<counter_statistics, Set::size> event_statistics{};
+  // Set by bench() with adaptive stopping (bench_parameter::target_precision)
+  // when the target precision was reached within the budget.
+  bool converged = false;
+  // Warm-up done by bench() before the measurement: samples, wall-clock
+  // nanoseconds, and whether steady_state_warmup found the samples
+  // stationary before its cap.
+  size_t warmup_samples = 0;
+  double warmup_ns = 0;
+  bool steady_state = false;
+  // With collector_options::inherit, the events also count in the threads
+  // that the measured code creates: `total` covers them all, and
+  // `thread_total` the calling thread alone (see calling_thread() and
+  // children()). Its elapsed time is that of `total`.
+  bool inherited = false;
+  basic_event_count<Set> thread_total{};
+  template <typename T> basic_event_aggregate &operator/=(T divisor) {
     total.elapsed /= double(divisor);
     for (size_t i = 0; i < total.event_counts.size(); i++) {
       total.event_counts[i] /= double(divisor);
@@ -95,9 +254,9 @@ struct event_aggregate {
     return *this;
   }
 
-  event_aggregate() = default;
+  basic_event_aggregate() = default;
 
-  void operator<<(const event_count &other) {
+  void operator<<(const basic_event_count<Set> &other) {
     if (iterations == 0 || other.elapsed < best.elapsed) {
       best = other;
     }
@@ -106,81 +265,868 @@ struct event_aggregate {
     }
     iterations++;
     total += other;
+    elapsed_statistics.update(other.elapsed_ns());
+    for (size_t i = 0; i < Set::size; i++) {
+      if (other.coverage[i] > 0) {
+        event_statistics[i].update(double(other.event_counts[i]));
+      }
+    }
+    for (size_t i = 0; i < Set::size; i++) {
+      if (other.coverage[i] > max_coverage[i]) {
+        max_coverage[i] = other.coverage[i];
+      }
+    }
+  }
+
+  // Adds the calling thread's share of the last sample given to operator<<.
+  void add_calling_thread(const basic_event_count<Set> &own) {
+    inherited = true;
+    thread_total += own;
+  }
+
+  // exact: every sample counted the event the whole time; missing: no sample
+  // counted it; scaled: the mean is (partly) an estimate.
+  count_confidence confidence(size_t i) const {
+    if (iterations == 0 || max_coverage[i] <= 0) {
+      return count_confidence::missing;
+    }
+    return total.coverage[i] >= 1 ? count_confidence::exact
+                                  : count_confidence::scaled;
+  }
+  template <class E> count_confidence confidence() const {
+    static_assert(Set::template contains<E>(), "event not in the event set");
+    return confidence(Set::template index_of<E>());
+  }
+
+  // Takes over the counters of every event that `pass` counted, leaving the
+  // elapsed times and the other events alone. Used to assemble the result of
+  // a multi-pass measurement (event_scheduling::multi_pass) from passes run
+  // with identical parameters.
+  void combine_pass(const basic_event_aggregate &pass) {
+    for (size_t i = 0; i < Set::size; i++) {
+      if (pass.max_coverage[i] <= 0) {
+        continue;
+      }
+      total.event_counts[i] = pass.total.event_counts[i];
+      total.coverage[i] = pass.total.coverage[i];
+      best.event_counts[i] = pass.best.event_counts[i];
+      best.coverage[i] = pass.best.coverage[i];
+      worst.event_counts[i] = pass.worst.event_counts[i];
+      worst.coverage[i] = pass.worst.coverage[i];
+      thread_total.event_counts[i] = pass.thread_total.event_counts[i];
+      thread_total.coverage[i] = pass.thread_total.coverage[i];
+      max_coverage[i] = pass.max_coverage[i];
+      event_statistics[i] = pass.event_statistics[i];
+    }
+  }
+
+  // Removes the median overhead of `cost` from every sample, clamping at
+  // zero. The mean, best and worst then describe the measured code alone,
+  // and so do the streaming statistics, clamped the same way.
+  void subtract_overhead(const basic_event_overhead<Set> &cost) {
+    overhead = cost;
+    if (overhead_subtracted || cost.samples == 0) {
+      return;
+    }
+    overhead_subtracted = true;
+    subtract_counted(total, cost.median);
+    subtract(best, cost.median);
+    subtract(worst, cost.median);
+    if (inherited) {
+      subtract_counted(thread_total, cost.median);
+    }
+    elapsed_statistics.subtract(cost.median.elapsed_ns());
+    for (size_t i = 0; i < Set::size; i++) {
+      event_statistics[i].subtract(double(cost.median.event_counts[i]));
+    }
   }
 
   double elapsed_sec() const { return total.elapsed_sec() / iterations / inner_count; }
   double total_elapsed_ns() const { return total.elapsed_ns(); }
   double elapsed_ns() const { return total.elapsed_ns() / iterations / inner_count; }
-  double cycles() const { return total.cycles() / iterations / inner_count; }
-  double branch_misses() const { return total.branch_misses() / iterations / inner_count; }
-  double branches() const { return total.branches() / iterations / inner_count; }
-  double instructions() const { return total.instructions() / iterations / inner_count; }
-  double cache_misses() const { return total.cache_misses() / iterations / inner_count; }
+  double cycles() const { return mean_or_zero<events::cycles>(); }
+  double branch_misses() const { return mean_or_zero<events::branch_misses>(); }
+  double branches() const { return mean_or_zero<events::branches>(); }
+  double instructions() const { return mean_or_zero<events::instructions>(); }
+  double cache_misses() const { return mean_or_zero<events::cache_misses>(); }
   double fastest_elapsed_ns() const { return best.elapsed_ns() / inner_count; }
   double fastest_cycles() const { return best.cycles() / inner_count; }
   double fastest_instructions() const { return best.instructions() / inner_count; }
   double fastest_branch_misses() const { return best.branch_misses() / inner_count; }
   double fastest_branches() const { return best.branches() / inner_count; }
   double fastest_cache_misses() const { return best.cache_misses() / inner_count; }
+  // Mean and best (fastest sample) per-call count of event `E`. The mean is
+  // over the samples that counted the event (see counted_samples()).
+  template <class E> double get() const {
+    static_assert(Set::template contains<E>(), "event not in the event set");
+    return get(Set::template index_of<E>());
+  }
+  template <class E> double fastest() const { return best.template get<E>() / inner_count; }
+  // Same, for the `i`-th event of the set (e.g. with a runtime event list).
+  double get(size_t i) const { return per_call(total.get(i), i); }
+  // Number of samples in which the `i`-th event was counted at all. A
+  // multiplexed event may miss samples that are shorter than the kernel's
+  // rotation interval; its sum only holds the other samples.
+  size_t counted_samples(size_t i) const {
+    return size_t(event_statistics[i].moments.count());
+  }
+  double fastest(size_t i) const { return best.get(i) / inner_count; }
+  double slowest_elapsed_ns() const { return worst.elapsed_ns() / inner_count; }
+  // With collector_options::inherit: the mean per-call count of the `i`-th
+  // (or `E`) event in the calling thread, and in the threads it created;
+  // both 0 when the calling thread's share is missing (see
+  // calling_thread_confidence()). Without it, everything was counted in the
+  // calling thread.
+  double calling_thread(size_t i) const {
+    if (!inherited) {
+      return get(i);
+    }
+    return thread_total.coverage[i] > 0 ? per_call(thread_total.get(i), i) : 0;
+  }
+  double children(size_t i) const {
+    if (!inherited || thread_total.coverage[i] <= 0 ||
+        thread_total.event_counts[i] >= total.event_counts[i]) {
+      return 0;
+    }
+    return per_call(double(total.event_counts[i] - thread_total.event_counts[i]),
+                    i);
+  }
+  template <class E> double calling_thread() const {
+    static_assert(Set::template contains<E>(), "event not in the event set");
+    return calling_thread(Set::template index_of<E>());
+  }
+  // Confidence of calling_thread() and children(), which take both groups
+  // of counters: missing if the calling thread's group did not count the
+  // event in every sample (it did not fit on the PMU next to the inherited
+  // group), scaled if either group was multiplexed, as confidence(i)
+  // otherwise.
+  count_confidence calling_thread_confidence(size_t i) const {
+    const count_confidence all = confidence(i);
+    if (!inherited || all == count_confidence::missing) {
+      return all;
+    }
+    if (thread_total.coverage[i] <= 0) {
+      return count_confidence::missing;
+    }
+    return thread_total.coverage[i] < 1 ? count_confidence::scaled : all;
+  }
+  template <class E> count_confidence calling_thread_confidence() const {
+    static_assert(Set::template contains<E>(), "event not in the event set");
+    return calling_thread_confidence(Set::template index_of<E>());
+  }
+  template <class E> double children() const {
+    static_assert(Set::template contains<E>(), "event not in the event set");
+    return children(Set::template index_of<E>());
+  }
+  // Per-call distribution over the samples: mean, standard deviation and
+  // error, quantiles and MAD, of the elapsed time in nanoseconds or of the
+  // `i`-th (or `E`) event.
+  sample_summary elapsed_summary() const {
+    return sample_summary::from(elapsed_statistics, inner_count);
+  }
+  // Confidence interval, at level `confidence`, of the median per-call
+  // elapsed time in nanoseconds.
+  std::pair<double, double>
+  elapsed_median_interval(double confidence = 0.95) const {
+    double low, high;
+    elapsed_statistics.quantiles.median_interval(
+        normal_quantile(0.5 + confidence / 2),
+        elapsed_statistics.moments.count(), low, high);
+    return {low / inner_count, high / inner_count};
+  }
+  sample_summary summary(size_t i) const {
+    return sample_summary::from(event_statistics[i], inner_count);
+  }
+  template <class E> sample_summary summary() const {
+    static_assert(Set::template contains<E>(), "event not in the event set");
+    return summary(Set::template index_of<E>());
+  }
   int iteration_count() const { return iterations; }
   int inner_iteration_count() const { return inner_count; }
+
+  /// Adds the samples of `other`, e.g. the aggregate of another thread, or
+  /// of another process through serialize(). Totals, best and worst samples,
+  /// coverage and streaming statistics combine as if every sample had been
+  /// added to one aggregate, and merging is associative. The totals, minima,
+  /// maxima and moments are exact; the quantiles are as accurate as the
+  /// sketches. If the inner counts differ, both sides first take their
+  /// least common multiple as the inner count, with every sample scaled to
+  /// keep its per-call values, so that each sample weighs the same in the
+  /// result. The overhead, warm-up and other details of the measurement
+  /// are those of this aggregate, or of `other` if this one is empty.
+  void merge(const basic_event_aggregate &other) {
+    if (other.iterations == 0) {
+      return;
+    }
+    if (iterations == 0) {
+      *this = other;
+      return;
+    }
+    // `other` is read in place, each of its samples scaled by `factor`.
+    int factor = 1;
+    if (other.inner_count != inner_count) {
+      const long long common = std::lcm((long long)inner_count,
+                                        (long long)other.inner_count);
+      if (inner_count <= 0 || other.inner_count <= 0 || common > INT_MAX) {
+        throw std::invalid_argument("incompatible inner counts");
+      }
+      scale_samples(int(common / inner_count));
+      factor = int(common / other.inner_count);
+    }
+    if (other.best.elapsed * factor < best.elapsed) {
+      best = scaled(other.best, factor);
+    }
+    if (other.worst.elapsed * factor > worst.elapsed) {
+      worst = scaled(other.worst, factor);
+    }
+    iterations += other.iterations;
+    total += scaled(other.total, factor);
+    if (other.inherited) {
+      inherited = true;
+      thread_total += scaled(other.thread_total, factor);
+    }
+    has_events = has_events || other.has_events;
+    merge_scaled(elapsed_statistics, other.elapsed_statistics, factor);
+    for (size_t i = 0; i < Set::size; i++) {
+      merge_scaled(event_statistics[i], other.event_statistics[i], factor);
+      if (other.max_coverage[i] > max_coverage[i]) {
+        max_coverage[i] = other.max_coverage[i];
+      }
+    }
+  }
+
+  /// Compact binary form of the aggregate, to reduce shards of several
+  /// processes without shipping their samples: the sums, best and worst
+  /// samples and streaming statistics, in little-endian order on every
+  /// platform. The event set must be the same on both ends (for a
+  /// runtime_event_set, the same events in the same order).
+  std::string serialize() const {
+    std::string bytes;
+    internal::byte_writer out{bytes};
+    out.u32(serialization_magic);
+    out.u32(uint32_t(Set::size));
+    out.u64(uint64_t(iterations));
+    out.u64(uint64_t(inner_count));
+    out.u8(has_events);
+    write_count(out, total);
+    write_count(out, best);
+    write_count(out, worst);
+    for (float coverage : max_coverage) {
+      out.f32(coverage);
+    }
+    elapsed_statistics.write(out);
+    for (const counter_statistics &statistics : event_statistics) {
+      statistics.write(out);
+    }
+    out.u64(overhead.samples);
+    write_count(out, overhead.minimum);
+    write_count(out, overhead.median);
+    write_count(out, overhead.maximum);
+    write_count(out, overhead.fence);
+    write_count(out, overhead.pause);
+    out.u64(overhead.pause_samples);
+    out.u8(overhead_subtracted);
+    out.f64(pauses_per_call);
+    out.f64(loop_overhead_ns);
+    out.u8(converged);
+    out.u64(warmup_samples);
+    out.f64(warmup_ns);
+    out.u8(steady_state);
+    out.u8(inherited);
+    write_count(out, thread_total);
+    return bytes;
+  }
+
+  /// Reads the result of serialize(). Throws std::invalid_argument if
+  /// `bytes` is not a serialized aggregate of the same event set.
+  static basic_event_aggregate deserialize(const std::string &bytes) {
+    internal::byte_reader in{
+        reinterpret_cast<const unsigned char *>(bytes.data()), bytes.size()};
+    if (in.u32() != serialization_magic) {
+      throw std::invalid_argument("not a serialized event aggregate");
+    }
+    if (in.u32() != Set::size) {
+      throw std::invalid_argument("serialized aggregate of another event set");
+    }
+    basic_event_aggregate result;
+    result.iterations = int(in.u64());
+    result.inner_count = int(in.u64());
+    result.has_events = in.u8() != 0;
+    read_count(in, result.total);
+    read_count(in, result.best);
+    read_count(in, result.worst);
+    for (float &coverage : result.max_coverage) {
+      coverage = in.f32();
+    }
+    result.elapsed_statistics.read(in);
+    for (counter_statistics &statistics : result.event_statistics) {
+      statistics.read(in);
+    }
+    result.overhead.samples = size_t(in.u64());
+    read_count(in, result.overhead.minimum);
+    read_count(in, result.overhead.median);
+    read_count(in, result.overhead.maximum);
+    read_count(in, result.overhead.fence);
+    read_count(in, result.overhead.pause);
+    result.overhead.pause_samples = size_t(in.u64());
+    result.overhead_subtracted = in.u8() != 0;
+    result.pauses_per_call = in.f64();
+    result.loop_overhead_ns = in.f64();
+    result.converged = in.u8() != 0;
+    result.warmup_samples = size_t(in.u64());
+    result.warmup_ns = in.f64();
+    result.steady_state = in.u8() != 0;
+    result.inherited = in.u8() != 0;
+    read_count(in, result.thread_total);
+    if (!in.done()) {
+      throw std::invalid_argument("trailing bytes after event aggregate");
+    }
+    return result;
+  }
+
+private:
+  // "CNT2" in the first four bytes: format version 2.
+  static constexpr uint32_t serialization_magic = 0x32544e43;
+
+  static void write_count(internal::byte_writer &out,
+                          const basic_event_count<Set> &count) {
+    out.f64(count.elapsed.count());
+    for (unsigned long long value : count.event_counts) {
+      out.u64(value);
+    }
+    for (float coverage : count.coverage) {
+      out.f32(coverage);
+    }
+  }
+  static void read_count(internal::byte_reader &in,
+                         basic_event_count<Set> &count) {
+    count.elapsed = std::chrono::duration<double>(in.f64());
+    for (unsigned long long &value : count.event_counts) {
+      value = in.u64();
+    }
+    for (float &coverage : count.coverage) {
+      coverage = in.f32();
+    }
+  }
+
+  static basic_event_count<Set> scaled(const basic_event_count<Set> &count,
+                                       int factor) {
+    basic_event_count<Set> result = count;
+    result.elapsed *= factor;
+    for (unsigned long long &value : result.event_counts) {
+      value *= (unsigned long long)factor;
+    }
+    return result;
+  }
+  // Merges `from` with its values multiplied by `factor`; only a scaled
+  // copy of one counter's statistics is made, and only if needed.
+  static void merge_scaled(counter_statistics &into,
+                           const counter_statistics &from, int factor) {
+    if (factor == 1) {
+      into.merge(from);
+      return;
+    }
+    counter_statistics multiplied = from;
+    multiplied.multiply(factor);
+    into.merge(multiplied);
+  }
+
+  // Multiplies every sample by `factor` and the inner count with it, which
+  // leaves the per-call values unchanged.
+  void scale_samples(int factor) {
+    for (basic_event_count<Set> *count : {&total, &best, &worst, &thread_total}) {
+      count->elapsed *= factor;
+      for (unsigned long long &value : count->event_counts) {
+        value *= (unsigned long long)factor;
+      }
+    }
+    elapsed_statistics.multiply(factor);
+    for (counter_statistics &statistics : event_statistics) {
+      statistics.multiply(factor);
+    }
+    inner_count *= factor;
+  }
+
+  // Mean per call of the `i`-th event, given its sum over the samples.
+  double per_call(double sum, size_t i) const {
+    const size_t samples = counted_samples(i);
+    return samples == 0 ? 0 : sum / double(samples) / inner_count;
+  }
+  template <class E> double mean_or_zero() const {
+    if constexpr (Set::template contains<E>()) {
+      return get<E>();
+    } else {
+      return 0;
+    }
+  }
+
+  // Removes `cost` from a sum of samples: the elapsed time once per sample,
+  // each event once per sample that counted it.
+  void subtract_counted(basic_event_count<Set> &count,
+                        const basic_event_count<Set> &cost) const {
+    const auto elapsed = cost.elapsed * iterations;
+    count.elapsed = count.elapsed > elapsed ? count.elapsed - elapsed
+                                            : std::chrono::duration<double>(0);
+    for (size_t i = 0; i < Set::size; i++) {
+      const unsigned long long value =
+          cost.event_counts[i] * (unsigned long long)counted_samples(i);
+      count.event_counts[i] =
+          count.event_counts[i] > value ? count.event_counts[i] - value : 0;
+    }
+  }
+
+  // Removes `cost` from one sample.
+  static void subtract(basic_event_count<Set> &count,
+                       const basic_event_count<Set> &cost) {
+    count.elapsed = count.elapsed > cost.elapsed
+                        ? count.elapsed - cost.elapsed
+                        : std::chrono::duration<double>(0);
+    for (size_t i = 0; i < Set::size; i++) {
+      count.event_counts[i] = count.event_counts[i] > cost.event_counts[i]
+                                  ? count.event_counts[i] - cost.event_counts[i]
+                                  : 0;
+    }
+  }
+
 };
 
-struct event_collector {
-  event_count count{};
+// The default collector counts cycles, instructions, branches, branch misses
+// and cache misses.
+using event_count = basic_event_count<default_event_set>;
+using event_aggregate = basic_event_aggregate<default_event_set>;
+
+/// Options for event_collector. Options that do not apply to the current
+/// platform are ignored.
+struct collector_options {
+  /// Linux only: read the counters from user space with `rdpmc` instead of
+  /// making system calls in start()/end(). Much cheaper per sample, which
+  /// matters when measuring very short code. Falls back to read() when the
+  /// kernel does not allow user-space counter access.
+  bool user_space_read = false;
+  /// What to do when the events do not all fit on the PMU. The default drops
+  /// events from the end of the list; event_scheduling::multiplex keeps them
+  /// all and reports scaled estimates (see basic_event_count::coverage);
+  /// event_scheduling::multi_pass splits them into groups that bench()
+  /// measures one after the other.
+  event_scheduling scheduling = event_scheduling::drop_excess;
+  /// How samples are timestamped. timer_backend::cycle_counter reads the
+  /// processor's constant-rate counter (rdtsc, cntvct_el0) instead of calling
+  /// steady_clock, which costs much less per sample.
+  timer_backend timer = timer_backend::steady_clock;
+  /// Precise mode: barriers around the timer and counter reads in start()
+  /// and end(), so that out-of-order execution does not move work across
+  /// the region boundaries. Needed for code of a few dozen cycles; the cost
+  /// of the barriers is reported by calibrate() (basic_event_overhead::fence).
+  measurement_fence fence = measurement_fence::none;
+  /// Linux only: also count the events of the threads that the measured
+  /// code creates, for callables that spawn or fork workers. end() then
+  /// returns the events of the calling thread and all its children, and
+  /// calling_thread_count() the calling thread's own share, from a second
+  /// group of counters that is not inherited. Both groups occupy the PMU at
+  /// once, and inherited counters cannot be read from user space, so this
+  /// costs more per sample. With the default scheduling, the second group
+  /// keeps only the events that fit next to the first; with multiplex or
+  /// multi_pass, the groups may be multiplexed against each other. Either
+  /// shows in basic_event_aggregate::calling_thread_confidence(). Only
+  /// threads created after the collector opened its counters are counted,
+  /// and a child's events are included whether it has exited or not.
+  bool inherit = false;
+
+  bool operator==(const collector_options &other) const {
+    return user_space_read == other.user_space_read &&
+           scheduling == other.scheduling && timer == other.timer &&
+           fence == other.fence && inherit == other.inherit;
+  }
+  bool operator!=(const collector_options &other) const {
+    return !(*this == other);
+  }
+};
+
+/// Collects the elapsed time and the events `Events...` (event tags from
+/// events.h, or a single event_set) over a code region. An empty list selects
+/// default_event_set. With a runtime_event_set, the events are given at run
+/// time as an event_list (Linux only).
+template <class... Events> struct basic_event_collector {
+  using event_set_type = event_set_t<Events...>;
+  using count_type = basic_event_count<event_set_type>;
+  using aggregate_type = basic_event_aggregate<event_set_type>;
+  using overhead_type = basic_event_overhead<event_set_type>;
+  count_type count{};
+  // Result of the last calibrate(), cleared when the collector is
+  // reconfigured.
+  overhead_type overhead{};
   std::chrono::time_point<std::chrono::steady_clock> start_clock{};
+  uint64_t start_ticks = 0; // with timer_backend::cycle_counter
+  collector_options options{};
 
 #if defined(__linux__)
+  std::vector<perf_event_config> linux_configs;
   LinuxEvents<PERF_TYPE_HARDWARE> linux_events;
-  event_collector()
-      : linux_events(std::vector<int>{
-            PERF_COUNT_HW_CPU_CYCLES,
-            PERF_COUNT_HW_INSTRUCTIONS,
-            PERF_COUNT_HW_BRANCH_INSTRUCTIONS, // Retired branch instructions
-            PERF_COUNT_HW_BRANCH_MISSES,
-            PERF_COUNT_HW_CACHE_MISSES,
-        }) {}
+  // With collector_options::inherit: the calling thread alone.
+  LinuxEvents<PERF_TYPE_HARDWARE> thread_events;
+  explicit basic_event_collector(
+      const collector_options &opts = collector_options())
+      : options(opts), linux_configs(static_configs()),
+        linux_events(linux_configs, linux_options(opts)),
+        thread_events(thread_configs(linux_configs, opts),
+                      linux_options(opts, false)) {
+    mark_unused_slots();
+    fit_thread_events();
+  }
+  // Runtime event selection: `Events...` must be a runtime_event_set large
+  // enough for `list`.
+  basic_event_collector(const event_list &list,
+                        const collector_options &opts = collector_options())
+      : options(opts), linux_configs(checked_configs(list)),
+        linux_events(linux_configs, linux_options(opts)),
+        thread_events(thread_configs(linux_configs, opts),
+                      linux_options(opts, false)) {
+    mark_unused_slots();
+    fit_thread_events();
+  }
   bool has_events() { return linux_events.is_working(); }
+  size_t pass_count() const { return linux_events.pass_count(); }
+  void select_pass(size_t pass) {
+    linux_events.select_pass(pass);
+    if (options.inherit) {
+      thread_events.select_pass(pass);
+    }
+  }
+  // Reopens the counters if `opts` differs from the current options.
+  void configure(const collector_options &opts) {
+    if (opts == options) return;
+    const bool reopen = opts.user_space_read != options.user_space_read ||
+                        opts.scheduling != options.scheduling ||
+                        opts.inherit != options.inherit;
+    options = opts;
+    if (reopen) {
+      open_events();
+    }
+    overhead = overhead_type{};
+  }
+  // Reopens the counters if `list` or `opts` differ from the current ones.
+  void configure(const event_list &list, const collector_options &opts) {
+    std::vector<perf_event_config> configs = checked_configs(list);
+    if (opts == options && configs == linux_configs) return;
+    options = opts;
+    linux_configs = std::move(configs);
+    open_events();
+    overhead = overhead_type{};
+    mark_unused_slots();
+  }
+
+private:
+  static std::vector<perf_event_config> static_configs() {
+    std::vector<perf_event_config> configs;
+    if constexpr (!event_set_type::is_runtime) {
+      for (event_kind kind : event_set_type::kinds) {
+        configs.push_back(perf_config_for(kind));
+      }
+    }
+    return configs;
+  }
+  static std::vector<perf_event_config> checked_configs(const event_list &list) {
+    static_assert(event_set_type::is_runtime,
+                  "runtime event lists need a runtime_event_set collector");
+    if (list.size() > event_set_type::size) {
+      throw std::invalid_argument("too many events for the collector");
+    }
+    return list.configs();
+  }
+  void open_events() {
+    linux_events = LinuxEvents<PERF_TYPE_HARDWARE>(linux_configs,
+                                                   linux_options(options));
+    thread_events = LinuxEvents<PERF_TYPE_HARDWARE>(
+        thread_configs(linux_configs, options), linux_options(options, false));
+    fit_thread_events();
+  }
+  // With collector_options::inherit and the default scheduling, each group
+  // fits on the PMU alone but both count at once: events are dropped from
+  // the end of thread_events until the two groups run together without
+  // being multiplexed against each other. The dropped events read as zero
+  // with a coverage of zero in calling_thread_count().
+  void fit_thread_events() {
+    if (!options.inherit ||
+        options.scheduling != event_scheduling::drop_excess) {
+      return;
+    }
+    std::vector<perf_event_config> configs = linux_configs;
+    configs.resize(thread_events.event_count());
+    while (!configs.empty() && !scheduled_together()) {
+      configs.pop_back();
+      thread_events = LinuxEvents<PERF_TYPE_HARDWARE>(
+          configs, linux_options(options, false));
+    }
+    for (size_t i = configs.size(); i < linux_configs.size(); i++) {
+      thread_count.event_counts[i] = 0;
+      thread_count.coverage[i] = 0;
+    }
+  }
+  // Whether both groups counted the whole of a short region.
+  bool scheduled_together() {
+    linux_events.start();
+    thread_events.start();
+    volatile int sink = 0;
+    for (int i = 0; i < 10000; ++i) sink += i;
+    thread_events.end(thread_count.event_counts.data(),
+                      thread_count.coverage.data());
+    linux_events.end(count.event_counts.data(), count.coverage.data());
+    return linux_events.last_scheduled() && thread_events.last_scheduled();
+  }
+  // The events of thread_events: none unless the main group is inherited.
+  static std::vector<perf_event_config>
+  thread_configs(const std::vector<perf_event_config> &configs,
+                 const collector_options &opts) {
+    return opts.inherit ? configs : std::vector<perf_event_config>();
+  }
+  // Slots past the configured events are never written by LinuxEvents.
+  void mark_unused_slots() {
+    for (size_t i = linux_configs.size(); i < event_set_type::size; i++) {
+      count.event_counts[i] = 0;
+      count.coverage[i] = 0;
+      thread_count.event_counts[i] = 0;
+      thread_count.coverage[i] = 0;
+    }
+  }
+  static perf_event_options linux_options(const collector_options &opts,
+                                          bool inherit = true) {
+    perf_event_options result;
+    result.user_read = opts.user_space_read;
+    result.scheduling = opts.scheduling;
+    result.inherit = inherit && opts.inherit;
+    return result;
+  }
+
+public:
 #elif defined(__APPLE__) && defined(__aarch64__)
   AppleEvents apple_events;
   performance_counters diff;
-  event_collector() : diff(0) { apple_events.setup_performance_counters(); }
+  explicit basic_event_collector(
+      const collector_options &opts = collector_options())
+      : options(opts), diff(0) {
+    apple_events.setup_performance_counters();
+  }
   bool has_events() { return apple_events.setup_performance_counters(); }
+  size_t pass_count() const { return 1; }
+  void select_pass(size_t) {}
+  void configure(const collector_options &opts) {
+    if (opts == options) return;
+    options = opts;
+    overhead = overhead_type{};
+  }
+
+private:
+  // kperf only provides the five default events.
+  static unsigned long long apple_value(const performance_counters &c,
+                                        event_kind kind) {
+    switch (kind) {
+    case event_kind::cycles: return c.cycles;
+    case event_kind::instructions: return c.instructions;
+    case event_kind::branches: return c.branches;
+    case event_kind::branch_misses: return c.missed_branches;
+    case event_kind::cache_misses: return c.cache_misses;
+    default: return 0;
+    }
+  }
+  static bool apple_supported(event_kind kind) {
+    return kind == event_kind::cycles || kind == event_kind::instructions ||
+           kind == event_kind::branches || kind == event_kind::branch_misses ||
+           kind == event_kind::cache_misses;
+  }
+
+public:
 #else
-  event_collector() {}
+  explicit basic_event_collector(
+      const collector_options &opts = collector_options())
+      : options(opts) {}
   bool has_events() { return false; }
+  size_t pass_count() const { return 1; }
+  void select_pass(size_t) {}
+  void configure(const collector_options &opts) {
+    if (opts == options) return;
+    options = opts;
+    overhead = overhead_type{};
+  }
 #endif
 
   inline void start() {
+    // Checked first: the first check calibrates the cycle counter.
+    const bool cycle_timer = uses_cycle_counter();
+    counters::fence(options.fence);
 #if defined(__linux)
     linux_events.start();
+    if (options.inherit) {
+      thread_events.start();
+    }
 #elif defined(__APPLE__) && defined(__aarch64__)
     if (has_events()) {
       diff = apple_events.get_counters();
     }
 #endif
-    start_clock = std::chrono::steady_clock::now();
+    counters::fence(options.fence);
+    if (cycle_timer) {
+      start_ticks = read_cycle_counter();
+    } else {
+      start_clock = std::chrono::steady_clock::now();
+    }
+    counters::fence(options.fence);
+  }
+  inline count_type &end() {
+    read_interval();
+    if (paused_intervals != 0) {
+      count += active;
+      thread_count += thread_active;
+      paused_intervals = 0;
+    }
+    return count;
+  }
+
+  /// With collector_options::inherit, the calling thread's own share of the
+  /// result of the last end(); the rest was counted in the threads that it
+  /// created. Otherwise (and on platforms without inherit), that result.
+  /// Events that did not fit on the PMU next to the inherited ones read as
+  /// zero with a coverage of zero.
+  const count_type &calling_thread_count() const {
+#if defined(__linux__)
+    if (options.inherit) {
+      return thread_count;
+    }
+#endif
+    return count;
   }
-  inline event_count &end() {
-    const auto end_clock = std::chrono::steady_clock::now();
+
+  /// Stops counting inside a region started by start(), until resume(): the
+  /// time and the events in between are left out of the result of end().
+  /// Every pause() must be followed by resume() before end(). A pair costs
+  /// about an end() and a start(): on Linux, disabling and re-enabling the
+  /// perf group, or two rdpmc snapshots with user_space_read. The cost
+  /// falls partly inside the region; calibrate_pause() measures it.
+  void pause() {
+    read_interval();
+    if (paused_intervals == 0) {
+      active = count;
+      thread_active = thread_count;
+    } else {
+      active += count;
+      thread_active += thread_count;
+    }
+    paused_intervals++;
+  }
+  void resume() { start(); }
+
+  /// True when samples are timestamped with the cycle counter: it was
+  /// requested in the options and cycle_counter_available() holds.
+  bool uses_cycle_counter() const {
+    return options.timer == timer_backend::cycle_counter &&
+           cycle_counter_available();
+  }
+
+  /// Measures `samples` empty regions through the same start()/end() path as
+  /// a real measurement and records the overhead, once per configuration:
+  /// later calls return the stored result unless more samples are asked for.
+  /// With a measurement fence, the empty regions are also measured without
+  /// it to isolate the cost of the barriers.
+  const overhead_type &calibrate(size_t samples = 1000) {
+    if (samples == 0 || overhead.samples >= samples) {
+      return overhead;
+    }
+    overhead = measure_overhead(samples);
+    if (options.fence != measurement_fence::none) {
+      const measurement_fence fence = options.fence;
+      options.fence = measurement_fence::none;
+      const overhead_type unfenced = measure_overhead(samples);
+      options.fence = fence;
+      overhead.set_fence_cost(unfenced);
+    }
+    return overhead;
+  }
+
+  /// Same as calibrate(), also measuring regions that contain a
+  /// pause()/resume() pair to record the cost of the pair in
+  /// `overhead.pause`.
+  const overhead_type &calibrate_pause(size_t samples = 1000) {
+    calibrate(samples);
+    if (samples == 0 || overhead.pause_samples >= samples) {
+      return overhead;
+    }
+    overhead.set_pause_cost(measure_overhead(samples, true));
+    return overhead;
+  }
+
+private:
+  // Counts of the intervals before each pause() of the current region.
+  count_type active{};
+  size_t paused_intervals = 0;
+  // With collector_options::inherit: the calling thread's counts, as in
+  // `count` and `active`.
+  count_type thread_count{};
+  count_type thread_active{};
+
+  // Reads the time and the events since the last start() into `count`.
+  inline void read_interval() {
+    const bool cycle_timer = uses_cycle_counter();
+    uint64_t end_ticks = 0;
+    std::chrono::time_point<std::chrono::steady_clock> end_clock{};
+    counters::fence(options.fence);
+    if (cycle_timer) {
+      end_ticks = read_cycle_counter_end();
+    } else {
+      end_clock = std::chrono::steady_clock::now();
+    }
+    counters::fence(options.fence);
 #if defined(__linux)
-    linux_events.end(count.event_counts);
+    if (options.inherit) {
+      thread_events.end(thread_count.event_counts.data(),
+                        thread_count.coverage.data());
+    }
+    linux_events.end(count.event_counts.data(), count.coverage.data());
 #elif __APPLE__ && __aarch64__
     if (has_events()) {
       performance_counters end = apple_events.get_counters();
       diff = end - diff;
     }
-    count.event_counts[0] = diff.cycles;
-    count.event_counts[1] = diff.instructions;
-    count.event_counts[2] = diff.branches;
-    count.event_counts[3] = diff.missed_branches;
-    count.event_counts[4] = diff.cache_misses;
+    if constexpr (event_set_type::is_runtime) {
+      count.coverage.fill(0);
+    } else {
+      for (size_t i = 0; i < event_set_type::size; i++) {
+        count.event_counts[i] = apple_value(diff, event_set_type::kinds[i]);
+        count.coverage[i] =
+            has_events() && apple_supported(event_set_type::kinds[i]) ? 1 : 0;
+      }
+    }
+#else
+    count.coverage.fill(0);
 #endif
-    count.elapsed = end_clock - start_clock;
-    return count;
+    count.elapsed = cycle_timer ? cycle_counter_duration(end_ticks - start_ticks)
+                                : end_clock - start_clock;
+    thread_count.elapsed = count.elapsed;
+  }
+
+  // Measures `samples` empty regions, with a pause()/resume() pair in each
+  // if `with_pause` is set.
+  overhead_type measure_overhead(size_t samples, bool with_pause = false) {
+    overhead_type result;
+    std::vector<count_type> measured(samples);
+    const size_t passes = pass_count();
+    for (size_t pass = 0; pass < passes; pass++) {
+      select_pass(pass);
+      for (count_type &sample : measured) {
+        start();
+        if (with_pause) {
+          pause();
+          resume();
+        }
+        sample = end();
+      }
+      result.add_pass(measured, pass == 0);
+    }
+    select_pass(0);
+    return result;
   }
 };
 
+using event_collector = basic_event_collector<>;
+
 inline bool has_performance_counters() {
   return counters::event_collector().has_events();
 }
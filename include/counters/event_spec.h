@@ -0,0 +1,276 @@
+#ifndef COUNTERS_EVENT_SPEC_H_
+#define COUNTERS_EVENT_SPEC_H_
+#ifdef __linux__
+
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "linux-perf-events.h"
+#include "pmu_events.h"
+
+namespace counters {
+
+namespace internal {
+struct named_perf_event {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+// Generic hardware and software event names, as accepted by `perf stat -e`.
+inline const std::vector<named_perf_event> &generic_perf_events() {
+  static const std::vector<named_perf_event> table = {
+      {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {"cpu-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+      {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+      {"branch-instructions", PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+      {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {"bus-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES},
+      {"stalled-cycles-frontend", PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+      {"idle-cycles-frontend", PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+      {"stalled-cycles-backend", PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+      {"idle-cycles-backend", PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+      {"ref-cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES},
+      {"cpu-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK},
+      {"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+      {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+      {"faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+      {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+      {"cs", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+      {"cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+      {"migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+      {"minor-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN},
+      {"major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ},
+      {"alignment-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_ALIGNMENT_FAULTS},
+      {"emulation-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_EMULATION_FAULTS},
+  };
+  return table;
+}
+
+// Parses perf's hardware cache event names: <cache>-<op>[-misses], e.g.
+// "L1-dcache-load-misses", "LLC-loads" or "dTLB-store-misses".
+inline bool parse_cache_event(const std::string &name, uint64_t &config) {
+  static const std::pair<const char *, uint64_t> caches[] = {
+      {"L1-dcache", PERF_COUNT_HW_CACHE_L1D},
+      {"L1-icache", PERF_COUNT_HW_CACHE_L1I},
+      {"LLC", PERF_COUNT_HW_CACHE_LL},
+      {"dTLB", PERF_COUNT_HW_CACHE_DTLB},
+      {"iTLB", PERF_COUNT_HW_CACHE_ITLB},
+      {"branch", PERF_COUNT_HW_CACHE_BPU},
+      {"node", PERF_COUNT_HW_CACHE_NODE},
+  };
+  // Accesses use the plural ("loads"), misses the singular ("load-misses").
+  static const std::pair<const char *, uint64_t> operations[] = {
+      {"load", PERF_COUNT_HW_CACHE_OP_READ},
+      {"store", PERF_COUNT_HW_CACHE_OP_WRITE},
+      {"prefetch", PERF_COUNT_HW_CACHE_OP_PREFETCH},
+  };
+  for (const auto &cache : caches) {
+    const std::string prefix = std::string(cache.first) + "-";
+    if (name.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+    const std::string rest = name.substr(prefix.size());
+    for (const auto &op : operations) {
+      const std::string singular = op.first;
+      const std::string plural =
+          singular + (singular == "prefetch" ? "es" : "s");
+      uint64_t result;
+      if (rest == plural) {
+        result = PERF_COUNT_HW_CACHE_RESULT_ACCESS;
+      } else if (rest == singular + "-misses") {
+        result = PERF_COUNT_HW_CACHE_RESULT_MISS;
+      } else {
+        continue;
+      }
+      config = perf_cache_config(cache.second, op.second, result);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parses a raw event "rNNNN" where NNNN is the hexadecimal config.
+inline bool parse_raw_event(const std::string &name, uint64_t &config) {
+  if (name.size() < 2 || name[0] != 'r') {
+    return false;
+  }
+  uint64_t value = 0;
+  for (size_t i = 1; i < name.size(); i++) {
+    const char c = name[i];
+    uint64_t digit;
+    if (c >= '0' && c <= '9') {
+      digit = uint64_t(c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      digit = uint64_t(c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+      digit = uint64_t(c - 'A' + 10);
+    } else {
+      return false;
+    }
+    if (i > 16) {
+      return false; // more than 64 bits
+    }
+    value = (value << 4) | digit;
+  }
+  config = value;
+  return true;
+}
+
+} // namespace internal
+
+/// A runtime list of named perf events. Unlike a compile-time event_set, the
+/// list can mix hardware, hardware-cache, software and raw events of any
+/// type, and it can come from a configuration file or an environment
+/// variable:
+///
+///   auto list = counters::event_list::parse(
+///       "cycles,instructions,L1-dcache-load-misses,dTLB-load-misses,r01c4,"
+///       "cpu/topdown-slots/");
+///   auto agg = counters::bench(list, [] { /* ... */ });
+///   double misses = agg.get(list.index_of("L1-dcache-load-misses"));
+class event_list {
+  std::vector<std::string> event_names{};
+  std::vector<perf_event_config> event_configs{};
+
+public:
+  static constexpr size_t npos = size_t(-1);
+
+  event_list() = default;
+
+  /// Parses a comma-separated list of perf-style event names. Throws
+  /// std::invalid_argument on an unknown name. Commas inside a PMU event
+  /// ("cpu/event=0x3c,umask=0x1/") do not separate events. PMU events are
+  /// looked up in `catalog`, or in pmu_catalog::system() when it is null.
+  static event_list parse(const std::string &spec,
+                          const pmu_catalog *catalog = nullptr) {
+    event_list list;
+    size_t begin = 0;
+    bool in_pmu = false;
+    for (size_t i = 0; i <= spec.size(); i++) {
+      if (i < spec.size() && spec[i] == '/') {
+        in_pmu = !in_pmu;
+      }
+      if (i == spec.size() || (spec[i] == ',' && !in_pmu)) {
+        const std::string name = internal::trim(spec.substr(begin, i - begin));
+        if (!name.empty()) {
+          list.add(name, catalog);
+        }
+        begin = i + 1;
+      }
+    }
+    return list;
+  }
+
+  /// Parses the list from the environment variable `variable`, or from
+  /// `fallback` when it is unset or empty.
+  static event_list from_environment(
+      const char *variable = "COUNTERS_EVENTS",
+      const std::string &fallback =
+          "cycles,instructions,branches,branch-misses,cache-misses") {
+    const char *value = std::getenv(variable);
+    if (value == nullptr || *value == '\0') {
+      return parse(fallback);
+    }
+    return parse(value);
+  }
+
+  /// Adds one event by name: a generic hardware or software event
+  /// ("cycles", "task-clock"), a cache event ("LLC-load-misses"), a raw
+  /// event ("r01c4"), a PMU event in perf syntax ("cpu/topdown-slots/",
+  /// "cpu/event=0xa3,umask=0x14,cmask=0x14/") or the bare name of an event
+  /// published in sysfs ("topdown-slots"). Sysfs events are looked up in
+  /// `catalog`, or in pmu_catalog::system() when it is null.
+  event_list &add(const std::string &name,
+                  const pmu_catalog *catalog = nullptr) {
+    for (const auto &event : internal::generic_perf_events()) {
+      if (name == event.name) {
+        return add(name, {event.type, event.config});
+      }
+    }
+    uint64_t config;
+    if (internal::parse_cache_event(name, config)) {
+      return add(name, {PERF_TYPE_HW_CACHE, config});
+    }
+    if (internal::parse_raw_event(name, config)) {
+      return add(name, {PERF_TYPE_RAW, config});
+    }
+    const pmu_catalog &pmus =
+        catalog != nullptr ? *catalog : pmu_catalog::system();
+    perf_event_config pmu_config{0, 0};
+    if (pmus.resolve(name, pmu_config)) {
+      return add(name, pmu_config);
+    }
+    if (const pmu_event *event = pmus.find("", name)) {
+      return add(name, event->config);
+    }
+    throw std::invalid_argument("unknown event: " + name);
+  }
+
+  event_list &add(event_kind kind) {
+    return add(event_name(kind), perf_config_for(kind));
+  }
+
+  event_list &add_raw(uint64_t config, const std::string &name = "") {
+    return add(name.empty() ? "r" + to_hex(config) : name,
+               {PERF_TYPE_RAW, config});
+  }
+
+  /// Adds an event with an explicit encoding, under the given name.
+  event_list &add(const std::string &name, const perf_event_config &config) {
+    event_names.push_back(name);
+    event_configs.push_back(config);
+    return *this;
+  }
+
+  size_t size() const { return event_names.size(); }
+  bool empty() const { return event_names.empty(); }
+  const std::vector<std::string> &names() const { return event_names; }
+  const std::vector<perf_event_config> &configs() const {
+    return event_configs;
+  }
+  const std::string &name(size_t i) const { return event_names[i]; }
+
+  /// Position of the event called `name`, or npos.
+  size_t index_of(const std::string &name) const {
+    for (size_t i = 0; i < event_names.size(); i++) {
+      if (event_names[i] == name) {
+        return i;
+      }
+    }
+    return npos;
+  }
+
+  bool operator==(const event_list &other) const {
+    return event_names == other.event_names &&
+           event_configs == other.event_configs;
+  }
+  bool operator!=(const event_list &other) const { return !(*this == other); }
+
+private:
+  static std::string to_hex(uint64_t value) {
+    const char *digits = "0123456789abcdef";
+    std::string result;
+    do {
+      result.insert(result.begin(), digits[value & 0xf]);
+      value >>= 4;
+    } while (value != 0);
+    return result;
+  }
+};
+
+} // namespace counters
+
+#endif // __linux__
+#endif // COUNTERS_EVENT_SPEC_H_
@@ -0,0 +1,213 @@
+#ifndef COUNTERS_EVENTS_H_
+#define COUNTERS_EVENTS_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace counters {
+
+/// Platform-neutral identifiers for the events a collector can count.
+/// Not every platform supports every event: unsupported events read as zero.
+enum class event_kind : uint8_t {
+  // Generic hardware events.
+  cycles,
+  instructions,
+  branches,
+  branch_misses,
+  cache_misses,
+  cache_references,
+  ref_cycles,
+  bus_cycles,
+  stalled_cycles_frontend,
+  stalled_cycles_backend,
+  // Cache and TLB events.
+  l1d_loads,
+  l1d_misses,
+  l1i_misses,
+  llc_loads,
+  llc_misses,
+  dtlb_loads,
+  dtlb_misses,
+  itlb_misses,
+  // Software events, maintained by the kernel.
+  task_clock,
+  page_faults,
+  context_switches,
+  cpu_migrations,
+};
+
+/// Returns the perf-style name of an event, e.g. "L1-dcache-load-misses".
+constexpr const char *event_name(event_kind kind) {
+  switch (kind) {
+  case event_kind::cycles: return "cycles";
+  case event_kind::instructions: return "instructions";
+  case event_kind::branches: return "branches";
+  case event_kind::branch_misses: return "branch-misses";
+  case event_kind::cache_misses: return "cache-misses";
+  case event_kind::cache_references: return "cache-references";
+  case event_kind::ref_cycles: return "ref-cycles";
+  case event_kind::bus_cycles: return "bus-cycles";
+  case event_kind::stalled_cycles_frontend: return "stalled-cycles-frontend";
+  case event_kind::stalled_cycles_backend: return "stalled-cycles-backend";
+  case event_kind::l1d_loads: return "L1-dcache-loads";
+  case event_kind::l1d_misses: return "L1-dcache-load-misses";
+  case event_kind::l1i_misses: return "L1-icache-load-misses";
+  case event_kind::llc_loads: return "LLC-loads";
+  case event_kind::llc_misses: return "LLC-load-misses";
+  case event_kind::dtlb_loads: return "dTLB-loads";
+  case event_kind::dtlb_misses: return "dTLB-load-misses";
+  case event_kind::itlb_misses: return "iTLB-load-misses";
+  case event_kind::task_clock: return "task-clock";
+  case event_kind::page_faults: return "page-faults";
+  case event_kind::context_switches: return "context-switches";
+  case event_kind::cpu_migrations: return "cpu-migrations";
+  }
+  return "unknown";
+}
+
+/// What a collector does when the requested events do not fit on the
+/// performance monitoring unit (PMU) at the same time.
+enum class event_scheduling : uint8_t {
+  /// Drop events from the end of the list until the rest can be counted
+  /// together. The dropped events read as zero.
+  drop_excess,
+  /// Keep every event and let the kernel time-multiplex them. Each count is
+  /// scaled by time_enabled / time_running, and a per-event coverage tells
+  /// how much of the sample the estimate is based on.
+  multiplex,
+  /// Split the events into consecutive groups that each fit on the PMU and
+  /// count one group per pass, rerunning the measurement for every pass.
+  /// Counts are exact, at the price of running the benchmark several times.
+  multi_pass,
+};
+
+/// How trustworthy a reported count is.
+enum class count_confidence : uint8_t {
+  exact,   ///< counted during the whole measurement
+  scaled,  ///< extrapolated from part of the measurement (multiplexing)
+  missing, ///< never counted; the value is zero
+};
+
+/// Compile-time event tags, used to select the events of a collector:
+///
+///   counters::basic_event_collector<counters::events::cycles,
+///                                   counters::events::instructions,
+///                                   counters::events::l1d_misses> c;
+namespace events {
+template <event_kind K> struct event_tag {
+  static constexpr event_kind kind = K;
+};
+
+using cycles = event_tag<event_kind::cycles>;
+using instructions = event_tag<event_kind::instructions>;
+using branches = event_tag<event_kind::branches>;
+using branch_misses = event_tag<event_kind::branch_misses>;
+using cache_misses = event_tag<event_kind::cache_misses>;
+using cache_references = event_tag<event_kind::cache_references>;
+using ref_cycles = event_tag<event_kind::ref_cycles>;
+using bus_cycles = event_tag<event_kind::bus_cycles>;
+using stalled_cycles_frontend = event_tag<event_kind::stalled_cycles_frontend>;
+using stalled_cycles_backend = event_tag<event_kind::stalled_cycles_backend>;
+using l1d_loads = event_tag<event_kind::l1d_loads>;
+using l1d_misses = event_tag<event_kind::l1d_misses>;
+using l1i_misses = event_tag<event_kind::l1i_misses>;
+using llc_loads = event_tag<event_kind::llc_loads>;
+using llc_misses = event_tag<event_kind::llc_misses>;
+using dtlb_loads = event_tag<event_kind::dtlb_loads>;
+using dtlb_misses = event_tag<event_kind::dtlb_misses>;
+using itlb_misses = event_tag<event_kind::itlb_misses>;
+using task_clock = event_tag<event_kind::task_clock>;
+using page_faults = event_tag<event_kind::page_faults>;
+using context_switches = event_tag<event_kind::context_switches>;
+using cpu_migrations = event_tag<event_kind::cpu_migrations>;
+} // namespace events
+
+namespace internal {
+// Whether no event appears twice in `Events...`.
+template <class... Events> constexpr bool distinct_events() {
+  constexpr size_t count = sizeof...(Events);
+  if constexpr (count < 2) {
+    return true;
+  } else {
+    constexpr event_kind kinds[] = {Events::kind...};
+    for (size_t i = 0; i < count; i++) {
+      for (size_t j = i + 1; j < count; j++) {
+        if (kinds[i] == kinds[j]) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+}
+} // namespace internal
+
+/// An ordered, compile-time list of distinct events. Counter `i` of a
+/// measurement taken with this set corresponds to the `i`-th event of the
+/// list.
+template <class... Events> struct event_set {
+  static_assert(sizeof...(Events) > 0, "an event set cannot be empty");
+  static_assert(internal::distinct_events<Events...>(),
+                "an event appears twice in the event set");
+  static constexpr size_t size = sizeof...(Events);
+  static constexpr bool is_runtime = false;
+  static constexpr std::array<event_kind, size> kinds = {Events::kind...};
+
+  template <class E> static constexpr bool contains() {
+    return (std::is_same<E, Events>::value || ...);
+  }
+
+  // Position of `E` in the list; only valid when contains<E>().
+  template <class E> static constexpr size_t index_of() {
+    constexpr bool matches[] = {std::is_same<E, Events>::value...};
+    for (size_t i = 0; i < size; i++) {
+      if (matches[i]) {
+        return i;
+      }
+    }
+    return size;
+  }
+};
+
+/// The events counted when none are specified.
+using default_event_set =
+    event_set<events::cycles, events::instructions, events::branches,
+              events::branch_misses, events::cache_misses>;
+
+/// Stands in for an event set chosen at run time, such as a perf-style event
+/// list parsed from a string (see event_list in event_spec.h). Provides
+/// storage for up to `Capacity` counters, addressed by position; the unused
+/// slots read as missing.
+template <size_t Capacity = 32> struct runtime_event_set {
+  static constexpr size_t size = Capacity;
+  static constexpr bool is_runtime = true;
+  template <class E> static constexpr bool contains() { return false; }
+  template <class E> static constexpr size_t index_of() { return Capacity; }
+};
+
+namespace internal {
+template <class... Events> struct make_event_set {
+  using type = event_set<Events...>;
+};
+template <> struct make_event_set<> {
+  using type = default_event_set;
+};
+template <class... Events> struct make_event_set<event_set<Events...>> {
+  using type = event_set<Events...>;
+};
+template <size_t Capacity>
+struct make_event_set<runtime_event_set<Capacity>> {
+  using type = runtime_event_set<Capacity>;
+};
+} // namespace internal
+
+/// `event_set_t<Events...>` is `event_set<Events...>`, the default set when
+/// `Events` is empty, or `Events` itself when it is already an event_set or a
+/// runtime_event_set.
+template <class... Events>
+using event_set_t = typename internal::make_event_set<Events...>::type;
+
+} // namespace counters
+#endif // COUNTERS_EVENTS_H_
@@ -0,0 +1,150 @@
+#ifndef COUNTERS_HISTOGRAM_H_
+#define COUNTERS_HISTOGRAM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace counters {
+
+/// Histogram of non-negative integer values (e.g. latencies in timer ticks)
+/// with logarithmic buckets, in the style of HdrHistogram: values below 128
+/// are recorded exactly, larger ones with a relative error below 1/64. The
+/// whole 64-bit range fits in 3776 buckets allocated at construction, so
+/// recording never allocates and memory stays bounded however many values
+/// are recorded.
+class latency_histogram {
+public:
+  static constexpr unsigned sub_bucket_bits = 7;
+  static constexpr size_t bucket_count =
+      (size_t(1) << sub_bucket_bits) +
+      (64 - sub_bucket_bits) * (size_t(1) << (sub_bucket_bits - 1));
+
+  latency_histogram() : counts(bucket_count, 0) {}
+
+  void record(uint64_t value, uint64_t times = 1) {
+    counts[index_of(value)] += times;
+    if (total == 0 || value < smallest) {
+      smallest = value;
+    }
+    if (total == 0 || value > largest) {
+      largest = value;
+    }
+    total += times;
+    sum += double(value) * double(times);
+  }
+
+  /// Adds the values recorded in `other`.
+  void merge(const latency_histogram &other) {
+    if (other.total == 0) {
+      return;
+    }
+    for (size_t i = 0; i < bucket_count; i++) {
+      counts[i] += other.counts[i];
+    }
+    if (total == 0 || other.smallest < smallest) {
+      smallest = other.smallest;
+    }
+    if (total == 0 || other.largest > largest) {
+      largest = other.largest;
+    }
+    total += other.total;
+    sum += other.sum;
+  }
+
+  void clear() {
+    counts.assign(bucket_count, 0);
+    total = 0;
+    sum = 0;
+    smallest = 0;
+    largest = 0;
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return smallest; }
+  uint64_t max() const { return largest; }
+  double mean() const { return total == 0 ? 0 : sum / double(total); }
+
+  /// Smallest value such that `p` percent of the recorded values are less or
+  /// equal to it, up to the bucket resolution (the highest value of the
+  /// bucket is returned, capped by max()). percentile(50) is the median.
+  uint64_t percentile(double p) const {
+    if (total == 0) {
+      return 0;
+    }
+    if (p <= 0) {
+      return smallest;
+    }
+    uint64_t rank = uint64_t(p / 100 * double(total) + 0.5);
+    if (rank == 0) {
+      rank = 1;
+    }
+    if (rank >= total) {
+      return largest;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        const uint64_t high = highest_in_bucket(i);
+        return high < largest ? (high > smallest ? high : smallest) : largest;
+      }
+    }
+    return largest;
+  }
+
+  /// Bucket of `value`: values below 2^sub_bucket_bits have their own bucket,
+  /// larger ones keep their top sub_bucket_bits bits.
+  static size_t index_of(uint64_t value) {
+    const unsigned msb = most_significant_bit(value);
+    if (msb < sub_bucket_bits) {
+      return size_t(value);
+    }
+    const unsigned shift = msb - (sub_bucket_bits - 1);
+    const size_t half = size_t(1) << (sub_bucket_bits - 1);
+    return (size_t(1) << sub_bucket_bits) + (shift - 1) * half +
+           (size_t(value >> shift) - half);
+  }
+
+  static uint64_t lowest_in_bucket(size_t index) {
+    if (index < (size_t(1) << sub_bucket_bits)) {
+      return index;
+    }
+    const size_t half = size_t(1) << (sub_bucket_bits - 1);
+    const size_t k = index - (size_t(1) << sub_bucket_bits);
+    const unsigned shift = unsigned(k / half) + 1;
+    return uint64_t(k % half + half) << shift;
+  }
+
+  static uint64_t highest_in_bucket(size_t index) {
+    if (index + 1 >= bucket_count) {
+      return UINT64_MAX;
+    }
+    return lowest_in_bucket(index + 1) - 1;
+  }
+
+private:
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  double sum = 0;
+  uint64_t smallest = 0;
+  uint64_t largest = 0;
+
+  static unsigned most_significant_bit(uint64_t value) {
+    if (value == 0) {
+      return 0;
+    }
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - unsigned(__builtin_clzll(value));
+#else
+    unsigned msb = 0;
+    while (value >>= 1) {
+      msb++;
+    }
+    return msb;
+#endif
+  }
+};
+
+} // namespace counters
+#endif // COUNTERS_HISTOGRAM_H_
@@ -5,29 +5,214 @@
 #include <asm/unistd.h>
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <atomic>
 #include <cerrno>
 #include <cstdint>
 #include <cstring>
+#include <fstream>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "events.h"
+
 namespace counters {
 
+/// One event of a perf group: the `type` and `config` fields of its
+/// perf_event_attr, plus `config1`/`config2` used by some model-specific
+/// events (see pmu_events.h). Events of different types can share a group.
+struct perf_event_config {
+  uint32_t type;
+  uint64_t config;
+  uint64_t config1 = 0;
+  uint64_t config2 = 0;
+
+  bool operator==(const perf_event_config &other) const {
+    return type == other.type && config == other.config &&
+           config1 == other.config1 && config2 == other.config2;
+  }
+  bool operator!=(const perf_event_config &other) const {
+    return !(*this == other);
+  }
+};
+
+namespace internal {
+constexpr uint64_t perf_cache_config(uint64_t cache, uint64_t op,
+                                     uint64_t result) {
+  return cache | (op << 8) | (result << 16);
+}
+} // namespace internal
+
+/// Maps a platform-neutral event to its generic perf encoding.
+inline perf_event_config perf_config_for(event_kind kind) {
+  using internal::perf_cache_config;
+  switch (kind) {
+  case event_kind::cycles:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES};
+  case event_kind::instructions:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS};
+  case event_kind::branches:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS};
+  case event_kind::branch_misses:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES};
+  case event_kind::cache_misses:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES};
+  case event_kind::cache_references:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES};
+  case event_kind::ref_cycles:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES};
+  case event_kind::bus_cycles:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES};
+  case event_kind::stalled_cycles_frontend:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND};
+  case event_kind::stalled_cycles_backend:
+    return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND};
+  case event_kind::l1d_loads:
+    return {PERF_TYPE_HW_CACHE,
+            perf_cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                              PERF_COUNT_HW_CACHE_RESULT_ACCESS)};
+  case event_kind::l1d_misses:
+    return {PERF_TYPE_HW_CACHE,
+            perf_cache_config(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                              PERF_COUNT_HW_CACHE_RESULT_MISS)};
+  case event_kind::l1i_misses:
+    return {PERF_TYPE_HW_CACHE,
+            perf_cache_config(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_OP_READ,
+                              PERF_COUNT_HW_CACHE_RESULT_MISS)};
+  case event_kind::llc_loads:
+    return {PERF_TYPE_HW_CACHE,
+            perf_cache_config(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                              PERF_COUNT_HW_CACHE_RESULT_ACCESS)};
+  case event_kind::llc_misses:
+    return {PERF_TYPE_HW_CACHE,
+            perf_cache_config(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                              PERF_COUNT_HW_CACHE_RESULT_MISS)};
+  case event_kind::dtlb_loads:
+    return {PERF_TYPE_HW_CACHE,
+            perf_cache_config(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                              PERF_COUNT_HW_CACHE_RESULT_ACCESS)};
+  case event_kind::dtlb_misses:
+    return {PERF_TYPE_HW_CACHE,
+            perf_cache_config(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                              PERF_COUNT_HW_CACHE_RESULT_MISS)};
+  case event_kind::itlb_misses:
+    return {PERF_TYPE_HW_CACHE,
+            perf_cache_config(PERF_COUNT_HW_CACHE_ITLB, PERF_COUNT_HW_CACHE_OP_READ,
+                              PERF_COUNT_HW_CACHE_RESULT_MISS)};
+  case event_kind::task_clock:
+    return {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK};
+  case event_kind::page_faults:
+    return {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS};
+  case event_kind::context_switches:
+    return {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES};
+  case event_kind::cpu_migrations:
+    return {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS};
+  }
+  return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES};
+}
+
+/// Options controlling how LinuxEvents opens and reads its counters.
+struct perf_event_options {
+  /// Read the counters from user space instead of issuing ioctl() and read()
+  /// system calls on every sample. Each event is mmapped and read with
+  /// `rdpmc` under the perf_event_mmap_page seqlock protocol; the group is
+  /// left enabled and start()/end() only take snapshots. Events the kernel
+  /// does not expose to user space (no `cap_user_rdpmc`, or a non-x86 CPU)
+  /// fall back to a single group read().
+  bool user_read = false;
+  /// What to do with events that do not fit on the PMU together: drop them,
+  /// multiplex them, or split them into several groups counted in separate
+  /// passes (see pass_count()/select_pass()). In multiplex mode every event
+  /// is opened as its own group and read separately, and user_read is
+  /// ignored. Each event is then enabled and disabled by its own system
+  /// call, all before any is read, so their windows are offset by a few
+  /// microseconds at most; an event that the kernel did not rotate onto the
+  /// PMU during a short window reads 0 with a coverage of 0.
+  event_scheduling scheduling = event_scheduling::drop_excess;
+  /// Also count in the threads and processes that the calling thread
+  /// creates after the counters are opened (perf `inherit`). The kernel
+  /// does not support group reads of inherited counters, so every event is
+  /// read on its own; the values include the children. user_read is
+  /// ignored, since rdpmc only sees the calling thread.
+  bool inherit = false;
+  /// What to count, as the `pid` and `cpu` arguments of perf_event_open:
+  /// by default the calling thread on any CPU. pid -1 with a CPU counts
+  /// every task on that CPU (system-wide, see system_wide.h), and a process
+  /// or thread ID with cpu -1 counts that task. Counting other tasks is
+  /// subject to perf_event_paranoid and ptrace permissions, and user_read
+  /// is ignored for them.
+  int pid = 0;
+  int cpu = -1;
+};
+
+/// Value of /proc/sys/kernel/perf_event_paranoid, or `fallback` if it cannot
+/// be read. At 1 or more, unprivileged processes may not count per CPU; at
+/// 2 or more, they may only count in user space.
+inline int perf_event_paranoid(int fallback = 2) {
+  std::ifstream file("/proc/sys/kernel/perf_event_paranoid");
+  int value = fallback;
+  if (!(file >> value)) {
+    return fallback;
+  }
+  return value;
+}
+
 template <int TYPE = PERF_TYPE_HARDWARE>
 class LinuxEvents {
   int fd{-1};
   bool working{false};
   bool last_read_scheduled{false};
+  // errno of the last perf_event_open() that failed, 0 if none did.
+  int error_number{0};
+  perf_event_options options{};
   perf_event_attr attribs{};
   size_t num_events{};
+  size_t requested_events{};
   std::vector<uint64_t> temp_result_vec{};
   std::vector<uint64_t> ids{};
   std::vector<int> all_fds{};
+  // User-space read mode only.
+  std::vector<perf_event_mmap_page *> pages{};
+  std::vector<uint64_t> start_values{};
+  std::vector<uint64_t> end_values{};
+  // Enabled and running times of the group at the last snapshot.
+  uint64_t start_time_enabled{};
+  uint64_t start_time_running{};
+  // The group read at start(), in the layout of temp_result_vec, or value,
+  // time_enabled and time_running per event when multiplexed. A reset only
+  // zeroes the counts of the calling thread: the times keep running since
+  // the counters were opened, and inherited counters keep the counts of
+  // exited children, so end() subtracts this reading.
+  std::vector<uint64_t> start_reading{};
+  // Multi-pass mode only: one group per pass and the index of its first
+  // event in the requested list.
+  std::vector<LinuxEvents> passes{};
+  std::vector<size_t> pass_offsets{};
+  size_t active_pass{};
 
 public:
-  explicit LinuxEvents(std::vector<int> config_vec) {
-    std::vector<int> current_configs = config_vec;
+  explicit LinuxEvents(std::vector<int> config_vec,
+                       perf_event_options opts = perf_event_options())
+      : LinuxEvents(typed_configs(config_vec), opts) {}
+
+  explicit LinuxEvents(std::vector<perf_event_config> config_vec,
+                       perf_event_options opts = perf_event_options())
+      : options(opts), requested_events(config_vec.size()) {
+    if (options.inherit || options.pid != 0 || options.cpu != -1) {
+      options.user_read = false;
+    }
+    if (options.scheduling == event_scheduling::multiplex) {
+      options.user_read = false;
+      open_multiplexed(config_vec);
+      return;
+    }
+    if (options.scheduling == event_scheduling::multi_pass) {
+      open_passes(config_vec);
+      return;
+    }
+    std::vector<perf_event_config> current_configs = config_vec;
 
     while (!current_configs.empty()) {
       if (!try_open(current_configs)) {
@@ -39,62 +224,237 @@ public:
       if (probe_scheduling()) {
         working = true;
         num_events = current_configs.size();
+        if (options.user_read) {
+          setup_user_read();
+        }
         return;
       }
 
       cleanup_fds();
       current_configs.pop_back();
     }
+    working = false;
+    num_events = 0;
+  }
+
+  LinuxEvents(const LinuxEvents &) = delete;
+  LinuxEvents &operator=(const LinuxEvents &) = delete;
+  LinuxEvents(LinuxEvents &&other) noexcept { *this = std::move(other); }
+  LinuxEvents &operator=(LinuxEvents &&other) noexcept {
+    if (this != &other) {
+      cleanup_fds();
+      fd = other.fd;
+      working = other.working;
+      last_read_scheduled = other.last_read_scheduled;
+      error_number = other.error_number;
+      options = other.options;
+      attribs = other.attribs;
+      num_events = other.num_events;
+      requested_events = other.requested_events;
+      temp_result_vec = std::move(other.temp_result_vec);
+      start_reading = std::move(other.start_reading);
+      ids = std::move(other.ids);
+      all_fds = std::move(other.all_fds);
+      pages = std::move(other.pages);
+      start_values = std::move(other.start_values);
+      end_values = std::move(other.end_values);
+      start_time_enabled = other.start_time_enabled;
+      start_time_running = other.start_time_running;
+      passes = std::move(other.passes);
+      pass_offsets = std::move(other.pass_offsets);
+      active_pass = other.active_pass;
+      other.fd = -1;
+      other.working = false;
+      other.all_fds.clear();
+      other.pages.clear();
+    }
+    return *this;
   }
 
   ~LinuxEvents() { cleanup_fds(); }
 
   inline void start() {
-    if (fd != -1) {
-      if (ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) == -1) {
-        report_error("ioctl(PERF_EVENT_IOC_RESET)");
+    if (!passes.empty()) {
+      passes[active_pass].start();
+      return;
+    }
+    if (fd == -1) return;
+    if (options.user_read) {
+      snapshot(start_values);
+      return;
+    }
+    if (options.scheduling == event_scheduling::multiplex) {
+      for (size_t i = 0; i < all_fds.size(); ++i) {
+        if (all_fds[i] == -1) continue;
+        if (ioctl(all_fds[i], PERF_EVENT_IOC_RESET, 0) == -1) {
+          report_error("ioctl(PERF_EVENT_IOC_RESET)");
+        }
+        if (!read_event(i, &start_reading[3 * i])) {
+          report_error("read");
+        }
       }
-      if (ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
-        report_error("ioctl(PERF_EVENT_IOC_ENABLE)");
+      // Enabled back to back (and disabled likewise in end()), so that the
+      // windows of the events differ by a few system calls only.
+      for (int f : all_fds) {
+        if (f != -1 && ioctl(f, PERF_EVENT_IOC_ENABLE, 0) == -1) {
+          report_error("ioctl(PERF_EVENT_IOC_ENABLE)");
+        }
       }
+      return;
+    }
+    if (ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) == -1) {
+      report_error("ioctl(PERF_EVENT_IOC_RESET)");
+    }
+    if (read_group()) {
+      start_reading = temp_result_vec;
+    } else {
+      report_error("read");
+    }
+    if (ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
+      report_error("ioctl(PERF_EVENT_IOC_ENABLE)");
     }
   }
 
-  inline void end(std::vector<unsigned long long> &results) {
+  // Writes one value per requested event to `results`. If `coverage` is not
+  // null, it receives the fraction of the measurement during which each event
+  // was actually counting: 1 for exact counts, 0 for events that were
+  // dropped or never scheduled. Multiplexed counts are scaled up by
+  // 1 / coverage.
+  inline void end(unsigned long long *results, float *coverage = nullptr) {
+    if (!passes.empty()) {
+      end_pass(results, coverage);
+      return;
+    }
     last_read_scheduled = false;
+    if (coverage != nullptr) {
+      for (size_t i = (fd == -1) ? 0 : num_events; i < requested_events; ++i) {
+        coverage[i] = 0;
+      }
+    }
     if (fd == -1) return;
 
+    if (options.scheduling == event_scheduling::multiplex) {
+      end_multiplexed(results, coverage);
+      return;
+    }
+
+    if (options.user_read) {
+      last_read_scheduled = snapshot(end_values);
+      for (size_t i = 0; i < num_events; ++i) {
+        results[i] = end_values[i] - start_values[i];
+        if (coverage != nullptr) coverage[i] = last_read_scheduled ? 1 : 0;
+      }
+      return;
+    }
+
     if (ioctl(fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP) == -1) {
       report_error("ioctl(PERF_EVENT_IOC_DISABLE)");
     }
-    if (read(fd, temp_result_vec.data(), temp_result_vec.size() * 8) == -1) {
+    if (!read_group()) {
       report_error("read");
       return;
     }
+    if (start_reading.size() == temp_result_vec.size()) {
+      for (size_t i = 1; i < temp_result_vec.size(); ++i) {
+        if (i < 3 || (i - 3) % 2 == 0) { // times and values, not the IDs
+          temp_result_vec[i] -= start_reading[i];
+        }
+      }
+    }
 
     // Layout with TOTAL_TIME_ENABLED | TOTAL_TIME_RUNNING | GROUP | ID:
     //   nr, time_enabled, time_running, { value, id } * nr
+    // with the times and values since start().
     uint64_t nr           = temp_result_vec[0];
     uint64_t time_enabled = temp_result_vec[1];
     uint64_t time_running = temp_result_vec[2];
 
     last_read_scheduled =
         (time_running > 0) && (time_running == time_enabled);
+    const float group_coverage =
+        time_enabled > 0 ? float(double(time_running) / double(time_enabled))
+                         : 0;
 
     for (uint64_t i = 0; i < nr; ++i) {
       uint64_t value = temp_result_vec[3 + 2 * i];
       uint64_t id    = temp_result_vec[3 + 2 * i + 1];
       results[i] = value;
+      if (coverage != nullptr) coverage[i] = group_coverage;
       if (ids[i] != id) report_error("event mismatch");
     }
   }
 
+  inline void end(std::vector<unsigned long long> &results) {
+    end(results.data());
+  }
+
+  // Number of passes needed to count every event: always 1 unless the
+  // scheduling is event_scheduling::multi_pass.
+  size_t pass_count() const { return passes.empty() ? 1 : passes.size(); }
+  // Selects the group counted by start()/end(). Events outside the selected
+  // pass read as zero with a coverage of zero.
+  void select_pass(size_t pass) {
+    if (passes.empty() || pass >= passes.size() || pass == active_pass) {
+      return;
+    }
+    // Groups read from user space run continuously; only the active one may
+    // occupy the PMU.
+    passes[active_pass].pause_user_read();
+    active_pass = pass;
+    passes[active_pass].resume_user_read();
+  }
+
+  // Reads the counts since start() without stopping the group: one value
+  // per counted event, and the group's enabled and running times in
+  // nanoseconds since it was opened. Only with the default scheduling and without user_read;
+  // false otherwise or if the read fails.
+  bool read_running(std::vector<uint64_t> &values, uint64_t &time_enabled,
+                    uint64_t &time_running) {
+    if (fd == -1 || !passes.empty() || options.user_read ||
+        options.scheduling == event_scheduling::multiplex) {
+      return false;
+    }
+    if (!read_group()) {
+      return false;
+    }
+    time_enabled = temp_result_vec[1];
+    time_running = temp_result_vec[2];
+    values.resize(num_events);
+    for (size_t i = 0; i < num_events; ++i) {
+      values[i] = temp_result_vec[3 + 2 * i];
+    }
+    return true;
+  }
+
   bool is_working() const { return working; }
+  // errno of the last failed perf_event_open(), e.g. EACCES when
+  // perf_event_paranoid forbids the target; 0 if every open succeeded.
+  int open_error() const { return error_number; }
+  // Whether every event counted during the whole of the last measurement.
   bool last_scheduled() const { return last_read_scheduled; }
+  // Number of events being counted. In drop_excess mode this can be less
+  // than the number of requested events.
   size_t event_count() const { return num_events; }
+  // True when every event can be read with rdpmc without a system call.
+  bool user_read_available() const {
+    if (pages.empty()) return false;
+    for (const perf_event_mmap_page *pc : pages) {
+      if (pc == nullptr || !pc->cap_user_rdpmc) return false;
+    }
+    return true;
+  }
 
 private:
-  bool try_open(const std::vector<int> &configs) {
+  static std::vector<perf_event_config>
+  typed_configs(const std::vector<int> &configs) {
+    std::vector<perf_event_config> result;
+    for (int config : configs) {
+      result.push_back({TYPE, static_cast<uint64_t>(config)});
+    }
+    return result;
+  }
+
+  bool try_open(const std::vector<perf_event_config> &configs) {
     working = true;
     fd = -1;
     all_fds.clear();
@@ -102,23 +462,31 @@ private:
     ids.assign(configs.size(), 0);
 
     memset(&attribs, 0, sizeof(attribs));
-    attribs.type           = TYPE;
     attribs.size           = sizeof(attribs);
     attribs.disabled       = 1;
     attribs.exclude_kernel = 1;
     attribs.exclude_hv     = 1;
     attribs.sample_period  = 0;
-    attribs.read_format    = PERF_FORMAT_GROUP
+    attribs.inherit        = options.inherit;
+    attribs.read_format    = options.inherit
+                           ? PERF_FORMAT_TOTAL_TIME_ENABLED
+                           | PERF_FORMAT_TOTAL_TIME_RUNNING
+                           : PERF_FORMAT_GROUP
                            | PERF_FORMAT_ID
                            | PERF_FORMAT_TOTAL_TIME_ENABLED
                            | PERF_FORMAT_TOTAL_TIME_RUNNING;
 
     int group = -1;
     for (size_t i = 0; i < configs.size(); ++i) {
-      attribs.config = configs[i];
+      attribs.type   = configs[i].type;
+      attribs.config = configs[i].config;
+      attribs.config1 = configs[i].config1;
+      attribs.config2 = configs[i].config2;
       int _fd = static_cast<int>(
-          syscall(__NR_perf_event_open, &attribs, 0, -1, group, 0UL));
+          syscall(__NR_perf_event_open, &attribs, options.pid, options.cpu,
+                  group, 0UL));
       if (_fd == -1) {
+        error_number = errno;
         report_error("perf_event_open");
         return false;
       }
@@ -145,16 +513,291 @@ private:
 
     if (ioctl(fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP) == -1) return false;
 
-    if (read(fd, temp_result_vec.data(), temp_result_vec.size() * 8) == -1) {
+    if (!read_group()) {
       return false;
     }
     uint64_t time_enabled = temp_result_vec[1];
     uint64_t time_running = temp_result_vec[2];
+    if (options.pid > 0 && time_enabled == 0) {
+      return true; // another task that did not run: nothing to tell
+    }
     return time_running > 0 && time_running == time_enabled;
   }
 
+  // Reads the group into temp_result_vec with the layout of a group read:
+  // nr, time_enabled, time_running, { value, id } * nr. Inherited counters
+  // are read one by one, with the times of the leader.
+  bool read_group() {
+    if (!options.inherit) {
+      return read(fd, temp_result_vec.data(), temp_result_vec.size() * 8) !=
+             -1;
+    }
+    temp_result_vec[0] = num_events;
+    for (size_t i = 0; i < num_events; ++i) {
+      uint64_t buffer[3];
+      if (!read_event(i, buffer)) {
+        return false;
+      }
+      if (i == 0) {
+        temp_result_vec[1] = buffer[1];
+        temp_result_vec[2] = buffer[2];
+      }
+      temp_result_vec[3 + 2 * i] = buffer[0];
+      temp_result_vec[3 + 2 * i + 1] = ids[i];
+    }
+    return true;
+  }
+
+  // Reads value, time_enabled and time_running of the `i`-th event alone.
+  bool read_event(size_t i, uint64_t *buffer) {
+    buffer[0] = buffer[1] = buffer[2] = 0;
+    return all_fds[i] != -1 &&
+           read(all_fds[i], buffer, 3 * sizeof(uint64_t)) != -1;
+  }
+
+  // Greedily packs the events into consecutive groups: each LinuxEvents
+  // keeps the longest prefix of the remaining events that can be scheduled
+  // together. An event that cannot be counted even on its own is skipped.
+  void open_passes(const std::vector<perf_event_config> &configs) {
+    perf_event_options group_options = options;
+    group_options.scheduling = event_scheduling::drop_excess;
+    size_t offset = 0;
+    while (offset < configs.size()) {
+      LinuxEvents group(std::vector<perf_event_config>(
+                            configs.begin() + static_cast<long>(offset),
+                            configs.end()),
+                        group_options);
+      const size_t taken = group.event_count();
+      if (group.open_error() != 0) {
+        error_number = group.open_error();
+      }
+      if (taken == 0) {
+        offset++;
+        continue;
+      }
+      group.pause_user_read();
+      pass_offsets.push_back(offset);
+      passes.push_back(std::move(group));
+      offset += taken;
+    }
+    num_events = configs.size();
+    working = !passes.empty();
+    if (working) {
+      passes[0].resume_user_read();
+    }
+  }
+
+  inline void end_pass(unsigned long long *results, float *coverage) {
+    for (size_t i = 0; i < requested_events; ++i) {
+      results[i] = 0;
+      if (coverage != nullptr) coverage[i] = 0;
+    }
+    const size_t offset = pass_offsets[active_pass];
+    LinuxEvents &group = passes[active_pass];
+    group.end(results + offset,
+              coverage == nullptr ? nullptr : coverage + offset);
+    last_read_scheduled = group.last_scheduled();
+    working = group.is_working();
+  }
+
+  void pause_user_read() {
+    if (options.user_read && fd != -1) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+  }
+
+  void resume_user_read() {
+    if (options.user_read && fd != -1) {
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+  }
+
+  // Opens every event as its own group so that the kernel can rotate them
+  // on the PMU. Events that cannot be opened at all are kept as
+  // placeholders and report a coverage of zero.
+  void open_multiplexed(const std::vector<perf_event_config> &configs) {
+    memset(&attribs, 0, sizeof(attribs));
+    attribs.size           = sizeof(attribs);
+    attribs.disabled       = 1;
+    attribs.exclude_kernel = 1;
+    attribs.exclude_hv     = 1;
+    attribs.inherit        = options.inherit;
+    attribs.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED
+                           | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    num_events = configs.size();
+    for (const perf_event_config &config : configs) {
+      attribs.type   = config.type;
+      attribs.config = config.config;
+      attribs.config1 = config.config1;
+      attribs.config2 = config.config2;
+      int _fd = static_cast<int>(
+          syscall(__NR_perf_event_open, &attribs, options.pid, options.cpu,
+                  -1, 0UL));
+      if (_fd == -1) {
+        error_number = errno;
+      }
+      all_fds.push_back(_fd);
+      if (_fd != -1 && fd == -1) {
+        fd = _fd;
+      }
+    }
+    start_reading.assign(3 * num_events, 0);
+    working = fd != -1;
+  }
+
+  inline void end_multiplexed(unsigned long long *results, float *coverage) {
+    for (int f : all_fds) {
+      if (f != -1 && ioctl(f, PERF_EVENT_IOC_DISABLE, 0) == -1) {
+        report_error("ioctl(PERF_EVENT_IOC_DISABLE)");
+      }
+    }
+    last_read_scheduled = true;
+    for (size_t i = 0; i < num_events; ++i) {
+      // value, time_enabled, time_running
+      uint64_t buffer[3];
+      if (!read_event(i, buffer)) {
+        buffer[0] = buffer[1] = buffer[2] = 0;
+      } else {
+        for (size_t k = 0; k < 3; ++k) {
+          buffer[k] -= start_reading[3 * i + k];
+        }
+      }
+      const uint64_t time_enabled = buffer[1];
+      const uint64_t time_running = buffer[2];
+      double ratio = 0;
+      if (time_running > 0) {
+        ratio = double(time_running) / double(time_enabled);
+        results[i] = static_cast<unsigned long long>(
+            double(buffer[0]) / ratio + 0.5);
+      } else {
+        results[i] = 0;
+      }
+      if (coverage != nullptr) coverage[i] = float(ratio);
+      if (time_running == 0 || time_running != time_enabled) {
+        last_read_scheduled = false;
+      }
+    }
+  }
+
+  // Maps the first page of every event and leaves the group running: in
+  // user-space read mode start()/end() never touch the kernel.
+  void setup_user_read() {
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    pages.assign(all_fds.size(), nullptr);
+    for (size_t i = 0; i < all_fds.size(); ++i) {
+      void *addr =
+          mmap(nullptr, page_size, PROT_READ, MAP_SHARED, all_fds[i], 0);
+      if (addr != MAP_FAILED) {
+        pages[i] = static_cast<perf_event_mmap_page *>(addr);
+      }
+    }
+    start_values.assign(num_events, 0);
+    end_values.assign(num_events, 0);
+    if (ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) == -1) {
+      report_error("ioctl(PERF_EVENT_IOC_RESET)");
+    }
+    if (ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
+      report_error("ioctl(PERF_EVENT_IOC_ENABLE)");
+    }
+  }
+
+  // Takes a snapshot of the running counters, preferring rdpmc. Returns
+  // whether all events were live on the PMU when read.
+  inline bool snapshot(std::vector<uint64_t> &values) {
+    bool user_ok = true;
+    uint64_t time_enabled = 0;
+    uint64_t time_running = 0;
+    for (size_t i = 0; i < num_events; ++i) {
+      if (!read_user(pages[i], values[i], i == 0 ? &time_enabled : nullptr,
+                     i == 0 ? &time_running : nullptr)) {
+        user_ok = false;
+        break;
+      }
+    }
+    if (user_ok) {
+      // The page's times are those of its last update, but a live counter
+      // has been running whenever enabled since then: the difference between
+      // the times is current, which is all that the fallback compares.
+      start_time_enabled = time_enabled;
+      start_time_running = time_running;
+      return true;
+    }
+    // Fallback: one group read(), counters keep running.
+    if (read(fd, temp_result_vec.data(), temp_result_vec.size() * 8) == -1) {
+      report_error("read");
+      return false;
+    }
+    time_enabled = temp_result_vec[1];
+    time_running = temp_result_vec[2];
+    for (size_t i = 0; i < num_events; ++i) {
+      values[i] = temp_result_vec[3 + 2 * i];
+      if (ids[i] != temp_result_vec[3 + 2 * i + 1]) {
+        report_error("event mismatch");
+      }
+    }
+    // Scheduled over the interval iff the counters ran whenever enabled.
+    const bool scheduled = (time_enabled - start_time_enabled) ==
+                           (time_running - start_time_running);
+    start_time_enabled = time_enabled;
+    start_time_running = time_running;
+    return scheduled;
+  }
+
+  // Reads one counter following the protocol documented in
+  // <linux/perf_event.h> for perf_event_mmap_page, and, if asked, the
+  // enabled and running times of the page within the same sequence.
+  static inline bool read_user(const perf_event_mmap_page *page,
+                               uint64_t &value,
+                               uint64_t *time_enabled = nullptr,
+                               uint64_t *time_running = nullptr) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (page == nullptr) return false;
+    const volatile perf_event_mmap_page *pc = page;
+    uint32_t seq;
+    uint64_t count, enabled, running;
+    do {
+      seq = pc->lock;
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+      const uint32_t index = pc->index;
+      if (!pc->cap_user_rdpmc || index == 0) return false;
+      const uint16_t width = pc->pmc_width;
+      uint32_t lo, hi;
+      __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index - 1));
+      int64_t pmc = static_cast<int64_t>((uint64_t(hi) << 32) | lo);
+      pmc = static_cast<int64_t>(static_cast<uint64_t>(pmc) << (64 - width)) >>
+            (64 - width);
+      count = static_cast<uint64_t>(pc->offset) + static_cast<uint64_t>(pmc);
+      enabled = pc->time_enabled;
+      running = pc->time_running;
+      std::atomic_signal_fence(std::memory_order_seq_cst);
+    } while (pc->lock != seq);
+    value = count;
+    if (time_enabled != nullptr) *time_enabled = enabled;
+    if (time_running != nullptr) *time_running = running;
+    return true;
+#else
+    (void)page;
+    (void)value;
+    (void)time_enabled;
+    (void)time_running;
+    return false;
+#endif
+  }
+
   void cleanup_fds() {
-    for (int f : all_fds) close(f);
+    if (!pages.empty()) {
+      const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+      for (perf_event_mmap_page *pc : pages) {
+        if (pc != nullptr) munmap(pc, page_size);
+      }
+      pages.clear();
+    }
+    for (int f : all_fds) {
+      if (f != -1) close(f);
+    }
+    passes.clear();
+    pass_offsets.clear();
+    active_pass = 0;
     all_fds.clear();
     fd = -1;
   }
@@ -0,0 +1,296 @@
+#ifndef COUNTERS_PARALLEL_H_
+#define COUNTERS_PARALLEL_H_
+
+#include "counters/bench.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace counters {
+
+/// Result of bench_parallel() for one thread count.
+template <class Set> struct basic_parallel_result {
+  size_t threads = 0;
+  /// Whether every worker could be pinned to its own CPU (Linux only). With
+  /// more workers than allowed CPUs, workers share CPUs round-robin and
+  /// yield instead of spinning at the barrier.
+  bool pinned = false;
+  /// One aggregate per worker, from its own collector: its samples of
+  /// inner_count calls, one per round.
+  std::vector<basic_event_aggregate<Set>> per_thread;
+  /// All workers together, one sample per round: the events summed over
+  /// the workers, and the time from the first worker's start to the last
+  /// worker's end, which includes any skew between them. inner_count is
+  /// the number of calls of all workers in a round, so the results are per
+  /// call and elapsed_ns() is the inverse of the throughput.
+  basic_event_aggregate<Set> merged;
+  /// Throughput relative to the first thread count of bench_parallel(),
+  /// scaled by that count (the usual speedup when it is 1), and speedup per
+  /// thread. Computed from the median round.
+  double speedup = 1;
+  double efficiency = 1;
+
+  /// Calls per second of all workers, from the median round.
+  double calls_per_second() const {
+    const double ns = merged.elapsed_summary().median;
+    return ns > 0 ? 1e9 / ns : 0;
+  }
+};
+
+namespace internal {
+inline void cpu_relax() {
+#if defined(COUNTERS_X86_CYCLE_COUNTER) && defined(_MSC_VER)
+  _mm_pause();
+#elif defined(COUNTERS_X86_CYCLE_COUNTER)
+  __asm__ volatile("pause");
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+  __asm__ volatile("yield");
+#endif
+}
+
+// Barrier for a fixed number of threads that spins instead of sleeping, so
+// that the threads leave it within a few hundred cycles of each other.
+// After `spin_limit` polls a waiting thread yields between polls, which
+// keeps oversubscribed runs progressing; `yield` makes it yield at once.
+class spin_barrier {
+public:
+  explicit spin_barrier(size_t count) : threads(count) {}
+
+  void arrive_and_wait(bool yield = false) {
+    const size_t generation = current.load(std::memory_order_acquire);
+    if (arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == threads) {
+      arrived.store(0, std::memory_order_relaxed);
+      current.store(generation + 1, std::memory_order_release);
+      return;
+    }
+    for (size_t polls = 0;
+         current.load(std::memory_order_acquire) == generation; polls++) {
+      if (yield || polls >= spin_limit) {
+        std::this_thread::yield();
+      } else {
+        cpu_relax();
+      }
+    }
+  }
+
+private:
+  static constexpr size_t spin_limit = 1 << 16;
+  const size_t threads;
+  std::atomic<size_t> arrived{0};
+  std::atomic<size_t> current{0};
+};
+
+// CPUs that the process may run on, in increasing order.
+inline std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+#if defined(__linux__)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  return cpus;
+}
+
+// Pins the calling thread to `cpu`; false if it is not possible.
+inline bool pin_current_thread(int cpu) {
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+// Calls function(thread) if it takes the worker index, function() otherwise.
+template <class Function>
+COUNTERS_FLATTEN void call_worker(Function &function, size_t thread) {
+  if constexpr (std::is_invocable_v<Function &, size_t>) {
+    function(thread);
+  } else {
+    function();
+  }
+}
+
+// State shared by the workers of one bench_parallel() run.
+template <class Set> struct parallel_rounds {
+  explicit parallel_rounds(size_t threads)
+      : start(threads), done(threads), counts(threads),
+        began(threads), ended(threads), pinned(threads) {}
+  spin_barrier start;
+  spin_barrier done;
+  std::atomic<bool> stop{false};
+  size_t inner = 1;
+  // Of the last round: each worker's counts, and the time just before its
+  // start() and just after its end().
+  std::vector<basic_event_count<Set>> counts;
+  std::vector<std::chrono::steady_clock::time_point> began, ended;
+  std::vector<char> pinned;
+};
+
+template <class Set>
+void merge_round(basic_parallel_result<Set> &result,
+                 const parallel_rounds<Set> &rounds) {
+  basic_event_count<Set> round = rounds.counts.front();
+  auto first = rounds.began.front();
+  auto last = rounds.ended.front();
+  for (size_t i = 0; i < rounds.counts.size(); i++) {
+    result.per_thread[i] << rounds.counts[i];
+    if (i > 0) {
+      round += rounds.counts[i];
+      first = rounds.began[i] < first ? rounds.began[i] : first;
+      last = rounds.ended[i] > last ? rounds.ended[i] : last;
+    }
+  }
+  round.elapsed = last - first;
+  result.merged << round;
+}
+
+// Runs `threads` pinned workers, each with its own collector, for rounds of
+// `inner` calls released together by a spin barrier. Worker 0 also records
+// each round and decides when to stop, while the others wait for the next
+// round, so that no extra thread competes for the CPUs.
+template <class... Events, class Function>
+basic_parallel_result<event_set_t<Events...>>
+bench_parallel_impl(Function &function, size_t threads, size_t inner,
+                    const bench_parameter &params,
+                    const std::vector<int> &cpus) {
+  using set_type = event_set_t<Events...>;
+  basic_parallel_result<set_type> result;
+  result.threads = threads;
+  result.per_thread.resize(threads);
+  parallel_rounds<set_type> rounds(threads);
+  rounds.inner = inner;
+  const size_t min_rounds = params.min_repeat == 0 ? 1 : params.min_repeat;
+  const size_t max_rounds =
+      params.max_repeat < min_rounds ? min_rounds : params.max_repeat;
+  // With more workers than CPUs, spinning only delays the others.
+  const bool yield = threads > cpus.size();
+  auto worker = [&, yield](size_t t) {
+    rounds.pinned[t] =
+        !cpus.empty() && pin_current_thread(cpus[t % cpus.size()]);
+    // Opened by the worker itself: the counters follow the opening thread.
+    basic_event_collector<Events...> collector(params.collector);
+    std::chrono::steady_clock::time_point begin{};
+    for (size_t round = 0;; round++) {
+      rounds.start.arrive_and_wait(yield);
+      if (rounds.stop.load(std::memory_order_relaxed)) {
+        break;
+      }
+      rounds.began[t] = std::chrono::steady_clock::now();
+      collector.start();
+      call_ntimes_runtime([&function, t] { call_worker(function, t); },
+                          rounds.inner);
+      rounds.counts[t] = collector.end();
+      rounds.ended[t] = std::chrono::steady_clock::now();
+      rounds.done.arrive_and_wait(yield);
+      if (t != 0 || round < min_rounds) { // the first rounds warm up
+        continue;
+      }
+      if (round == min_rounds) {
+        begin = rounds.began[0];
+      }
+      merge_round(result, rounds);
+      const size_t measured = round + 1 - min_rounds;
+      if (measured >= max_rounds ||
+          (measured >= min_rounds &&
+           std::chrono::steady_clock::now() - begin >=
+               std::chrono::nanoseconds(params.min_time_ns))) {
+        rounds.stop.store(true, std::memory_order_relaxed);
+      }
+    }
+  };
+  std::vector<std::thread> workers;
+  workers.reserve(threads);
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back(worker, t);
+  }
+  for (std::thread &w : workers) {
+    w.join();
+  }
+  result.pinned = true;
+  for (size_t t = 0; t < threads; t++) {
+    result.per_thread[t].inner_count = int(inner);
+    result.pinned = result.pinned && rounds.pinned[t] != 0;
+  }
+  result.merged.inner_count = int(inner * threads);
+  return result;
+}
+} // namespace internal
+
+/// Measures how `function` scales with the number of threads. For every
+/// count in `thread_counts`, that many worker threads are started, each
+/// pinned to its own CPU where possible and counting its own events. In
+/// every round, a spin barrier releases the workers together, each makes
+/// the same number of calls, and the round ends when all are done:
+///
+///   auto curve = counters::bench_parallel(
+///       [&](size_t thread) { kernel(shard[thread]); }, {1, 2, 4, 8});
+///   for (auto &point : curve) {
+///     printf("%zu threads: speedup %.2f, efficiency %.2f\n", point.threads,
+///            point.speedup, point.efficiency);
+///   }
+///
+/// `function` is called as function(thread index) if it accepts one,
+/// function() otherwise, concurrently from all workers. The calls per round
+/// are chosen once, on the calling thread, like the inner repeat count of
+/// bench(). Each thread count gets `params.min_repeat` warm-up rounds and
+/// then measured rounds until `params.min_time_ns` has elapsed, within
+/// [min_repeat, max_repeat]. event_scheduling::multi_pass is not supported:
+/// only the first group of events is counted.
+template <class... Events, class Function>
+std::vector<basic_parallel_result<event_set_t<Events...>>>
+bench_parallel(Function &&function, const std::vector<size_t> &thread_counts,
+               const bench_parameter &params = bench_parameter()) {
+  std::vector<basic_parallel_result<event_set_t<Events...>>> curve;
+  if (thread_counts.empty()) {
+    return curve;
+  }
+  auto single = [&function] { internal::call_worker(function, 0); };
+  const size_t inner = bench_inner_repeat_impl(
+      single, thread_collector<Events...>(params.collector), params);
+  const std::vector<int> cpus = internal::allowed_cpus();
+  for (size_t threads : thread_counts) {
+    curve.push_back(internal::bench_parallel_impl<Events...>(
+        function, threads == 0 ? 1 : threads, inner, params, cpus));
+  }
+  const double base = curve.front().calls_per_second();
+  for (auto &point : curve) {
+    if (base > 0) {
+      point.speedup = point.calls_per_second() / base *
+                      double(curve.front().threads);
+    }
+    point.efficiency = point.speedup / double(point.threads);
+  }
+  return curve;
+}
+
+/// Same, for a single thread count.
+template <class... Events, class Function>
+basic_parallel_result<event_set_t<Events...>>
+bench_parallel(Function &&function, size_t threads,
+               const bench_parameter &params = bench_parameter()) {
+  return bench_parallel<Events...>(std::forward<Function>(function),
+                                   std::vector<size_t>{threads}, params)
+      .front();
+}
+
+} // namespace counters
+#endif // COUNTERS_PARALLEL_H_
@@ -0,0 +1,308 @@
+#ifndef COUNTERS_PMU_EVENTS_H_
+#define COUNTERS_PMU_EVENTS_H_
+#ifdef __linux__
+
+#include <dirent.h>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "linux-perf-events.h"
+
+namespace counters {
+
+/// One field of a PMU's event encoding, described by a file under
+/// `<pmu>/format/`: e.g. `umask` with contents "config:8-15". A field can be
+/// split over several bit ranges ("config:0-7,32-35").
+struct pmu_format_field {
+  std::string name;
+  // 0 for config, 1 for config1, 2 for config2.
+  int target = 0;
+  // Inclusive bit ranges, lowest value bits first.
+  std::vector<std::pair<unsigned, unsigned>> ranges{};
+};
+
+/// A named event published by a PMU under `<pmu>/events/`, e.g.
+/// cpu/topdown-slots with the encoding "event=0x00,umask=0x4".
+struct pmu_event {
+  std::string pmu;
+  std::string name;
+  std::string encoding;
+  perf_event_config config{0, 0};
+};
+
+/// A PMU found under the event_source devices directory.
+struct pmu_description {
+  std::string name;
+  uint32_t type = 0;
+  std::vector<pmu_format_field> formats{};
+};
+
+namespace internal {
+inline std::string trim(const std::string &s) {
+  const char *whitespace = " \t\r\n";
+  const size_t begin = s.find_first_not_of(whitespace);
+  if (begin == std::string::npos) {
+    return "";
+  }
+  const size_t end = s.find_last_not_of(whitespace);
+  return s.substr(begin, end - begin + 1);
+}
+
+inline bool read_first_line(const std::string &path, std::string &line) {
+  std::ifstream in(path);
+  if (!in) {
+    return false;
+  }
+  std::getline(in, line);
+  return true;
+}
+
+inline std::vector<std::string> list_directory(const std::string &path) {
+  std::vector<std::string> entries;
+  DIR *dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return entries;
+  }
+  while (dirent *entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name != "." && name != "..") {
+      entries.push_back(name);
+    }
+  }
+  closedir(dir);
+  return entries;
+}
+
+inline bool parse_unsigned(const std::string &text, uint64_t &value) {
+  if (text.empty()) {
+    return false;
+  }
+  char *end = nullptr;
+  value = std::strtoull(text.c_str(), &end, 0); // accepts 0x.. and decimal
+  return end != nullptr && *end == '\0';
+}
+
+// Events come with optional companion files, e.g. "topdown-slots.scale".
+inline bool is_event_companion(const std::string &name) {
+  for (const char *suffix : {".scale", ".unit", ".per-pkg", ".snapshot"}) {
+    const size_t length = std::char_traits<char>::length(suffix);
+    if (name.size() > length &&
+        name.compare(name.size() - length, length, suffix) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parses a format description such as "config1:0-15" or "config:0-7,32-35".
+inline bool parse_format(const std::string &text, pmu_format_field &field) {
+  const size_t colon = text.find(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  const std::string target = trim(text.substr(0, colon));
+  if (target == "config") {
+    field.target = 0;
+  } else if (target == "config1") {
+    field.target = 1;
+  } else if (target == "config2") {
+    field.target = 2;
+  } else {
+    return false;
+  }
+  std::stringstream ranges(text.substr(colon + 1));
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    range = trim(range);
+    const size_t dash = range.find('-');
+    uint64_t low, high;
+    if (dash == std::string::npos) {
+      if (!parse_unsigned(range, low)) return false;
+      high = low;
+    } else if (!parse_unsigned(range.substr(0, dash), low) ||
+               !parse_unsigned(range.substr(dash + 1), high)) {
+      return false;
+    }
+    if (low > high || high > 63) {
+      return false;
+    }
+    field.ranges.emplace_back(unsigned(low), unsigned(high));
+  }
+  return !field.ranges.empty();
+}
+
+// Scatters `value` into the bit ranges of `field`.
+inline void deposit(const pmu_format_field &field, uint64_t value,
+                    perf_event_config &config) {
+  uint64_t *target = field.target == 0   ? &config.config
+                     : field.target == 1 ? &config.config1
+                                         : &config.config2;
+  for (const auto &range : field.ranges) {
+    const unsigned width = range.second - range.first + 1;
+    const uint64_t mask = width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+    *target = (*target & ~(mask << range.first)) | ((value & mask) << range.first);
+    value = width == 64 ? 0 : value >> width;
+  }
+}
+} // namespace internal
+
+/// The named events and encodings that PMUs publish in sysfs, under
+/// `/sys/bus/event_source/devices/<pmu>/{type,format,events}`. This gives
+/// access to model-specific events (e.g. `cpu/topdown-slots/`) without
+/// hand-writing raw codes for every CPU generation.
+///
+///   auto catalog = counters::pmu_catalog::discover();
+///   counters::perf_event_config config;
+///   if (catalog.resolve("cpu/event=0x3c,umask=0x1/", config)) { ... }
+class pmu_catalog {
+  std::vector<pmu_description> pmu_list{};
+  std::vector<pmu_event> event_entries{};
+
+public:
+  static constexpr const char *default_root = "/sys/bus/event_source/devices";
+
+  /// Scans `root` (a directory laid out like the sysfs one, which lets tests
+  /// use a fake tree). PMUs without a readable `type` file are skipped, as
+  /// are events whose encoding uses unknown terms.
+  static pmu_catalog discover(const std::string &root = default_root) {
+    pmu_catalog catalog;
+    for (const std::string &name : internal::list_directory(root)) {
+      const std::string dir = root + "/" + name;
+      std::string line;
+      uint64_t type;
+      if (!internal::read_first_line(dir + "/type", line) ||
+          !internal::parse_unsigned(internal::trim(line), type)) {
+        continue;
+      }
+      pmu_description pmu;
+      pmu.name = name;
+      pmu.type = uint32_t(type);
+      for (const std::string &format :
+           internal::list_directory(dir + "/format")) {
+        pmu_format_field field;
+        field.name = format;
+        if (internal::read_first_line(dir + "/format/" + format, line) &&
+            internal::parse_format(line, field)) {
+          pmu.formats.push_back(field);
+        }
+      }
+      catalog.pmu_list.push_back(pmu);
+      for (const std::string &event :
+           internal::list_directory(dir + "/events")) {
+        if (internal::is_event_companion(event) ||
+            !internal::read_first_line(dir + "/events/" + event, line)) {
+          continue;
+        }
+        pmu_event entry;
+        entry.pmu = name;
+        entry.name = event;
+        entry.encoding = internal::trim(line);
+        if (catalog.encode(catalog.pmu_list.back(), entry.encoding,
+                           entry.config)) {
+          catalog.event_entries.push_back(entry);
+        }
+      }
+    }
+    return catalog;
+  }
+
+  /// The catalog of the running system, discovered once.
+  static const pmu_catalog &system() {
+    static const pmu_catalog catalog = discover();
+    return catalog;
+  }
+
+  const std::vector<pmu_description> &pmus() const { return pmu_list; }
+  const std::vector<pmu_event> &events() const { return event_entries; }
+
+  const pmu_description *find_pmu(const std::string &name) const {
+    for (const auto &pmu : pmu_list) {
+      if (pmu.name == name) return &pmu;
+    }
+    return nullptr;
+  }
+
+  /// Finds event `name` of PMU `pmu`. With an empty `pmu`, the core PMUs
+  /// ("cpu", "cpu_core", "armv8_pmuv3*") are preferred over the others.
+  const pmu_event *find(const std::string &pmu, const std::string &name) const {
+    const pmu_event *fallback = nullptr;
+    for (const auto &event : event_entries) {
+      if (event.name != name) continue;
+      if (!pmu.empty()) {
+        if (event.pmu == pmu) return &event;
+        continue;
+      }
+      if (is_core_pmu(event.pmu)) return &event;
+      if (fallback == nullptr) fallback = &event;
+    }
+    return fallback;
+  }
+
+  /// Resolves "pmu/name/" or "pmu/term=value,.../" (perf syntax) to an
+  /// encoding. Returns false if the PMU, the event or a term is unknown.
+  bool resolve(const std::string &spec, perf_event_config &config) const {
+    const size_t first = spec.find('/');
+    if (first == std::string::npos || spec.empty() || spec.back() != '/') {
+      return false;
+    }
+    const std::string pmu_name = spec.substr(0, first);
+    const std::string body = spec.substr(first + 1, spec.size() - first - 2);
+    const pmu_description *pmu = find_pmu(pmu_name);
+    if (pmu == nullptr) {
+      return false;
+    }
+    if (body.find('=') == std::string::npos) {
+      const pmu_event *event = find(pmu_name, body);
+      if (event == nullptr) return false;
+      config = event->config;
+      return true;
+    }
+    return encode(*pmu, body, config);
+  }
+
+  /// Encodes "event=0x3c,umask=0x1,..." using the formats of `pmu`. A term
+  /// without a value ("edge") sets the field to 1.
+  bool encode(const pmu_description &pmu, const std::string &terms,
+              perf_event_config &config) const {
+    config = perf_event_config{pmu.type, 0};
+    std::stringstream stream(terms);
+    std::string term;
+    while (std::getline(stream, term, ',')) {
+      term = internal::trim(term);
+      if (term.empty()) continue;
+      const size_t equal = term.find('=');
+      const std::string key = internal::trim(term.substr(0, equal));
+      uint64_t value = 1;
+      if (equal != std::string::npos &&
+          !internal::parse_unsigned(internal::trim(term.substr(equal + 1)),
+                                    value)) {
+        return false;
+      }
+      const pmu_format_field *field = nullptr;
+      for (const auto &format : pmu.formats) {
+        if (format.name == key) field = &format;
+      }
+      if (field == nullptr) {
+        return false;
+      }
+      internal::deposit(*field, value, config);
+    }
+    return true;
+  }
+
+private:
+  static bool is_core_pmu(const std::string &name) {
+    return name == "cpu" || name == "cpu_core" ||
+           name.compare(0, 11, "armv8_pmuv3") == 0;
+  }
+};
+
+} // namespace counters
+
+#endif // __linux__
+#endif // COUNTERS_PMU_EVENTS_H_
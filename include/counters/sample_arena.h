@@ -0,0 +1,129 @@
+#ifndef COUNTERS_SAMPLE_ARENA_H_
+#define COUNTERS_SAMPLE_ARENA_H_
+
+#include <cstddef>
+#include <vector>
+
+#include "counters/event_counter.h"
+
+namespace counters {
+
+/// Read-only view of `size` contiguous values (std::span is C++20).
+template <class T> struct sample_span {
+  const T *values = nullptr;
+  size_t count = 0;
+
+  const T *data() const { return values; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  const T *begin() const { return values; }
+  const T *end() const { return values + count; }
+  const T &operator[](size_t i) const { return values[i]; }
+};
+
+/// Storage for every individual sample of a measurement, for analyses that
+/// need more than the aggregate (bootstrapping, autocorrelation, drift over
+/// time). The samples are kept as a structure of arrays: one array for the
+/// elapsed times and one per counter, all allocated by reserve() so that
+/// recording never allocates. Samples beyond the capacity are dropped and
+/// counted in dropped().
+///
+///   counters::sample_arena arena(params.max_repeat);
+///   auto agg = counters::bench(f, params, arena);
+///   for (double ns : arena.elapsed_ns()) { ... }
+///
+/// Values are per sample, i.e. for inner_count() calls, without overhead
+/// subtraction.
+template <class Set> class basic_sample_arena {
+public:
+  basic_sample_arena() = default;
+  explicit basic_sample_arena(size_t samples, size_t counters = Set::size) {
+    reserve(samples, counters);
+  }
+
+  /// Makes room for `samples` samples of the first `counters` events
+  /// (fewer than Set::size saves memory with a runtime_event_set), and
+  /// clears the arena. Does not allocate if the arena is already as large.
+  void reserve(size_t samples, size_t counters = Set::size) {
+    if (counters > Set::size) {
+      counters = Set::size;
+    }
+    if (samples > sample_capacity || counters != counter_count) {
+      elapsed.assign(samples, 0);
+      counts.assign(samples * counters, 0);
+      sample_capacity = samples;
+      counter_count = counters;
+    }
+    clear();
+  }
+
+  void clear() {
+    recorded = 0;
+    dropped_samples = 0;
+    inner = 1;
+  }
+
+  /// Appends `sample`, or, for pass > 0 of a multi-pass measurement, stores
+  /// the events that this pass counted in the existing sample `row`.
+  void record(const basic_event_count<Set> &sample, size_t pass = 0,
+              size_t row = 0) {
+    if (pass == 0) {
+      if (recorded == sample_capacity) {
+        dropped_samples++;
+        return;
+      }
+      row = recorded++;
+      elapsed[row] = sample.elapsed_ns();
+      for (size_t i = 0; i < counter_count; i++) {
+        counts[i * sample_capacity + row] = sample.event_counts[i];
+      }
+      return;
+    }
+    if (row >= recorded) {
+      return;
+    }
+    for (size_t i = 0; i < counter_count; i++) {
+      if (sample.coverage[i] > 0) {
+        counts[i * sample_capacity + row] = sample.event_counts[i];
+      }
+    }
+  }
+
+  size_t size() const { return recorded; }
+  size_t capacity() const { return sample_capacity; }
+  /// Number of events stored per sample.
+  size_t counters() const { return counter_count; }
+  size_t dropped() const { return dropped_samples; }
+  /// Calls of the benchmarked function per sample.
+  size_t inner_count() const { return inner; }
+  void set_inner_count(size_t calls) { inner = calls; }
+
+  sample_span<double> elapsed_ns() const { return {elapsed.data(), recorded}; }
+  /// Counts of the `i`-th event, one per sample; empty if the event is not
+  /// stored (see reserve()).
+  sample_span<unsigned long long> counts_of(size_t i) const {
+    if (i >= counter_count) {
+      return {};
+    }
+    return {counts.data() + i * sample_capacity, recorded};
+  }
+  template <class E> sample_span<unsigned long long> counts_of() const {
+    static_assert(Set::template contains<E>(), "event not in the event set");
+    return counts_of(Set::template index_of<E>());
+  }
+
+private:
+  std::vector<double> elapsed{};
+  // Counter i of sample j is at counts[i * sample_capacity + j].
+  std::vector<unsigned long long> counts{};
+  size_t sample_capacity = 0;
+  size_t counter_count = Set::size;
+  size_t recorded = 0;
+  size_t dropped_samples = 0;
+  size_t inner = 1;
+};
+
+using sample_arena = basic_sample_arena<default_event_set>;
+
+} // namespace counters
+#endif // COUNTERS_SAMPLE_ARENA_H_
@@ -0,0 +1,85 @@
+#ifndef COUNTERS_SERIALIZATION_H_
+#define COUNTERS_SERIALIZATION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace counters {
+namespace internal {
+
+// Appends values to a byte string in little-endian order, whatever the
+// platform's byte order.
+struct byte_writer {
+  std::string &out;
+
+  void u8(uint8_t value) { out.push_back(char(value)); }
+  void u32(uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+      u8(uint8_t(value >> (8 * i)));
+    }
+  }
+  void u64(uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+      u8(uint8_t(value >> (8 * i)));
+    }
+  }
+  void f32(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    u32(bits);
+  }
+  void f64(double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    u64(bits);
+  }
+};
+
+// Reads what byte_writer wrote; throws std::invalid_argument when the input
+// is too short.
+struct byte_reader {
+  const unsigned char *data;
+  size_t size;
+  size_t offset = 0;
+
+  uint8_t u8() {
+    if (offset >= size) {
+      throw std::invalid_argument("truncated counters data");
+    }
+    return data[offset++];
+  }
+  uint32_t u32() {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+      value |= uint32_t(u8()) << (8 * i);
+    }
+    return value;
+  }
+  uint64_t u64() {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+      value |= uint64_t(u8()) << (8 * i);
+    }
+    return value;
+  }
+  float f32() {
+    const uint32_t bits = u32();
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+  double f64() {
+    const uint64_t bits = u64();
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+  bool done() const { return offset == size; }
+};
+
+} // namespace internal
+} // namespace counters
+#endif // COUNTERS_SERIALIZATION_H_
@@ -0,0 +1,510 @@
+#ifndef COUNTERS_STATISTICS_H_
+#define COUNTERS_STATISTICS_H_
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+#include "counters/serialization.h"
+
+namespace counters {
+
+/// Mean and variance of a stream of values, updated in O(1) with Welford's
+/// algorithm, and mergeable with Chan et al.'s formula.
+struct running_statistics {
+  uint64_t n = 0;
+  double mean_value = 0;
+  double m2 = 0; // sum of squared deviations from the mean
+
+  void update(double x) {
+    n++;
+    const double delta = x - mean_value;
+    mean_value += delta / double(n);
+    m2 += delta * (x - mean_value);
+  }
+
+  void merge(const running_statistics &other) {
+    if (other.n == 0) {
+      return;
+    }
+    if (n == 0) {
+      *this = other;
+      return;
+    }
+    const double total = double(n + other.n);
+    const double delta = other.mean_value - mean_value;
+    mean_value += delta * double(other.n) / total;
+    m2 += other.m2 + delta * delta * double(n) * double(other.n) / total;
+    n += other.n;
+  }
+
+  // Adds `delta` to every value seen so far.
+  void shift(double delta) { mean_value += delta; }
+  // Subtracts `value` from every value seen so far, clamping the mean at
+  // zero as a sum clamped at zero would be; the variance is unchanged.
+  void subtract(double value) {
+    mean_value = mean_value > value ? mean_value - value : 0;
+  }
+  // Multiplies every value seen so far by `factor`.
+  void multiply(double factor) {
+    mean_value *= factor;
+    m2 *= factor * factor;
+  }
+
+  void write(internal::byte_writer &out) const {
+    out.u64(n);
+    out.f64(mean_value);
+    out.f64(m2);
+  }
+  void read(internal::byte_reader &in) {
+    n = in.u64();
+    mean_value = in.f64();
+    m2 = in.f64();
+  }
+
+  uint64_t count() const { return n; }
+  double mean() const { return mean_value; }
+  // Sample variance (divided by n - 1).
+  double variance() const { return n > 1 ? m2 / double(n - 1) : 0; }
+  double stddev() const { return std::sqrt(variance()); }
+  double standard_error() const {
+    return n > 0 ? stddev() / std::sqrt(double(n)) : 0;
+  }
+};
+
+/// Quantile sketch of a stream of values: a merging t-digest with at most
+/// `capacity` centroids plus a small buffer, all stored inline. Updates are
+/// O(1) amortized and never allocate; two sketches can be merged. Quantiles
+/// are most accurate in the tails (p99, p99.9), where a t-digest keeps its
+/// smallest centroids.
+class quantile_sketch {
+public:
+  static constexpr size_t capacity = 128;
+  static constexpr size_t buffer_capacity = 64;
+  // t-digest compression: the sketch keeps at most about this many centroids.
+  static constexpr double compression = 100;
+
+  void update(double x) {
+    if (total == 0 || x < smallest) {
+      smallest = x;
+    }
+    if (total == 0 || x > largest) {
+      largest = x;
+    }
+    total++;
+    buffer[buffered++] = x;
+    if (buffered == buffer_capacity) {
+      compress();
+    }
+  }
+
+  void merge(const quantile_sketch &other) {
+    if (other.total == 0) {
+      return;
+    }
+    if (total == 0 || other.smallest < smallest) {
+      smallest = other.smallest;
+    }
+    if (total == 0 || other.largest > largest) {
+      largest = other.largest;
+    }
+    total += other.total;
+    std::array<centroid, 2 * (capacity + buffer_capacity)> items;
+    size_t count = gather(items.data());
+    count += other.gather(items.data() + count);
+    rebuild(items.data(), count);
+  }
+
+  // Adds `delta` to every value seen so far.
+  void shift(double delta) {
+    for (size_t i = 0; i < centroid_count; i++) {
+      centroids[i].mean += delta;
+    }
+    for (size_t i = 0; i < buffered; i++) {
+      buffer[i] += delta;
+    }
+    smallest += delta;
+    largest += delta;
+  }
+
+  // Subtracts `value` from every value seen so far, clamping each at zero.
+  void subtract(double value) {
+    auto clamped = [value](double x) { return x > value ? x - value : 0; };
+    for (size_t i = 0; i < centroid_count; i++) {
+      centroids[i].mean = clamped(centroids[i].mean);
+    }
+    for (size_t i = 0; i < buffered; i++) {
+      buffer[i] = clamped(buffer[i]);
+    }
+    smallest = clamped(smallest);
+    largest = clamped(largest);
+  }
+
+  // Multiplies every value seen so far by `factor`, which must be positive.
+  void multiply(double factor) {
+    for (size_t i = 0; i < centroid_count; i++) {
+      centroids[i].mean *= factor;
+    }
+    for (size_t i = 0; i < buffered; i++) {
+      buffer[i] *= factor;
+    }
+    smallest *= factor;
+    largest *= factor;
+  }
+
+  // Only the centroids and buffered values in use are written.
+  void write(internal::byte_writer &out) const {
+    out.f64(total);
+    out.f64(smallest);
+    out.f64(largest);
+    out.u32(uint32_t(centroid_count));
+    for (size_t i = 0; i < centroid_count; i++) {
+      out.f64(centroids[i].mean);
+      out.f64(centroids[i].weight);
+    }
+    out.u32(uint32_t(buffered));
+    for (size_t i = 0; i < buffered; i++) {
+      out.f64(buffer[i]);
+    }
+  }
+  void read(internal::byte_reader &in) {
+    total = in.f64();
+    smallest = in.f64();
+    largest = in.f64();
+    centroid_count = in.u32();
+    if (centroid_count > capacity) {
+      throw std::invalid_argument("invalid quantile sketch");
+    }
+    for (size_t i = 0; i < centroid_count; i++) {
+      centroids[i].mean = in.f64();
+      centroids[i].weight = in.f64();
+    }
+    buffered = in.u32();
+    if (buffered >= buffer_capacity) {
+      throw std::invalid_argument("invalid quantile sketch");
+    }
+    for (size_t i = 0; i < buffered; i++) {
+      buffer[i] = in.f64();
+    }
+  }
+
+  uint64_t count() const { return uint64_t(total); }
+  double min() const { return total == 0 ? nan() : smallest; }
+  double max() const { return total == 0 ? nan() : largest; }
+
+  /// Estimated value below which a fraction `q` (between 0 and 1) of the
+  /// values fall.
+  double quantile(double q) const {
+    if (total == 0) {
+      return nan();
+    }
+    compress();
+    return compressed_quantile(q);
+  }
+  double median() const { return quantile(0.5); }
+
+  /// Distribution-free confidence interval of the median of `n` samples:
+  /// the order statistics at ranks n/2 -/+ z sqrt(n)/2, estimated by the
+  /// sketch. `z` is the normal quantile of the confidence level (1.96 for
+  /// 95%).
+  void median_interval(double z, uint64_t n, double &low,
+                       double &high) const {
+    if (n == 0 || total == 0) {
+      low = high = nan();
+      return;
+    }
+    const double half_width = z / (2 * std::sqrt(double(n)));
+    compress();
+    low = compressed_quantile(std::max(0.0, 0.5 - half_width));
+    high = compressed_quantile(std::min(1.0, 0.5 + half_width));
+  }
+
+  /// Median absolute deviation from the median: a spread estimate that,
+  /// unlike the standard deviation, ignores a few extreme samples. Computed
+  /// from the centroids, so it shares the sketch's accuracy.
+  double mad() const {
+    if (total == 0) {
+      return nan();
+    }
+    compress();
+    const double m = compressed_quantile(0.5);
+    std::array<centroid, capacity> deviations;
+    for (size_t i = 0; i < centroid_count; i++) {
+      deviations[i] = {std::fabs(centroids[i].mean - m), centroids[i].weight};
+    }
+    std::sort(deviations.begin(), deviations.begin() + centroid_count,
+              [](const centroid &a, const centroid &b) {
+                return a.mean < b.mean;
+              });
+    double seen = 0;
+    for (size_t i = 0; i < centroid_count; i++) {
+      seen += deviations[i].weight;
+      if (seen >= total / 2) {
+        return deviations[i].mean;
+      }
+    }
+    return 0;
+  }
+
+private:
+  struct centroid {
+    double mean;
+    double weight;
+  };
+  // The queries fold the buffered values into the centroids first, in
+  // place: that changes the representation, not the values summarized. A
+  // sketch must therefore not be queried from several threads at once.
+  mutable std::array<centroid, capacity> centroids{};
+  mutable size_t centroid_count = 0;
+  mutable std::array<double, buffer_capacity> buffer{};
+  mutable size_t buffered = 0;
+  double total = 0;
+  double smallest = 0;
+  double largest = 0;
+
+  static double nan() { return std::numeric_limits<double>::quiet_NaN(); }
+  static constexpr double pi = 3.14159265358979323846;
+
+  // k1 scale function of the t-digest and its inverse: centroids near the
+  // extreme quantiles are kept small.
+  static double scale(double q) {
+    return compression / (2 * pi) * std::asin(2 * q - 1);
+  }
+  static double inverse_scale(double k) {
+    return (std::sin(k * 2 * pi / compression) + 1) / 2;
+  }
+
+  // Copies the centroids and the buffered values to `items`.
+  size_t gather(centroid *items) const {
+    size_t count = 0;
+    for (size_t i = 0; i < centroid_count; i++) {
+      items[count++] = centroids[i];
+    }
+    for (size_t i = 0; i < buffered; i++) {
+      items[count++] = {buffer[i], 1};
+    }
+    return count;
+  }
+
+  void compress() const {
+    if (buffered == 0) {
+      return;
+    }
+    std::array<centroid, capacity + buffer_capacity> items;
+    rebuild(items.data(), gather(items.data()));
+  }
+
+  // Replaces the centroids with `items` (which may be reordered), merging
+  // neighbours as long as they stay within one unit of the scale function.
+  void rebuild(centroid *items, size_t count) const {
+    std::sort(items, items + count, [](const centroid &a, const centroid &b) {
+      return a.mean < b.mean;
+    });
+    buffered = 0;
+    centroid_count = 0;
+    if (count == 0) {
+      return;
+    }
+    double weight_before = 0; // weight of the finished centroids
+    centroid current = items[0];
+    double limit = total * inverse_scale(scale(0) + 1);
+    for (size_t i = 1; i < count; i++) {
+      const double merged = weight_before + current.weight + items[i].weight;
+      if (merged <= limit) {
+        current.mean += (items[i].mean - current.mean) * items[i].weight /
+                        (current.weight + items[i].weight);
+        current.weight += items[i].weight;
+        continue;
+      }
+      push(current);
+      weight_before += current.weight;
+      limit = total * inverse_scale(scale(weight_before / total) + 1);
+      current = items[i];
+    }
+    push(current);
+  }
+
+  void push(const centroid &c) const {
+    if (centroid_count == capacity) {
+      // Not expected with the k1 scale function; fold into the last one.
+      centroid &last = centroids[capacity - 1];
+      last.mean += (c.mean - last.mean) * c.weight / (last.weight + c.weight);
+      last.weight += c.weight;
+      return;
+    }
+    centroids[centroid_count++] = c;
+  }
+
+  // Interpolates between the centroid centers; requires buffered == 0.
+  double compressed_quantile(double q) const {
+    if (centroid_count == 1 || q <= 0 || q >= 1) {
+      return q <= 0 ? smallest : q >= 1 ? largest : centroids[0].mean;
+    }
+    const double index = q * total;
+    const centroid &first = centroids[0];
+    if (index < first.weight / 2) {
+      return smallest + (first.mean - smallest) * index / (first.weight / 2);
+    }
+    double position = first.weight / 2; // center of the current centroid
+    for (size_t i = 0; i + 1 < centroid_count; i++) {
+      const double step = (centroids[i].weight + centroids[i + 1].weight) / 2;
+      if (position + step > index) {
+        const double fraction = (index - position) / step;
+        return centroids[i].mean +
+               (centroids[i + 1].mean - centroids[i].mean) * fraction;
+      }
+      position += step;
+    }
+    const centroid &last = centroids[centroid_count - 1];
+    const double fraction = (index - position) / (last.weight / 2);
+    return last.mean + (largest - last.mean) * std::min(fraction, 1.0);
+  }
+};
+
+/// Quantile of the standard normal distribution, e.g. normal_quantile(0.975)
+/// is about 1.96 (Acklam's rational approximation, relative error below
+/// 1.2e-9).
+inline double normal_quantile(double p) {
+  if (p <= 0 || p >= 1) {
+    return p <= 0 ? -std::numeric_limits<double>::infinity()
+                  : std::numeric_limits<double>::infinity();
+  }
+  static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02,
+                             -2.759285104469687e+02, 1.383577518672690e+02,
+                             -3.066479806614716e+01, 2.506628277459239e+00};
+  static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02,
+                             -1.556989798598866e+02, 6.680131188771972e+01,
+                             -1.328068155288572e+01};
+  static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01,
+                             -2.400758277161838e+00, -2.549732539343734e+00,
+                             4.374664141464968e+00,  2.938163982698783e+00};
+  static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01,
+                             2.445134137142996e+00, 3.754408661907416e+00};
+  const double low = 0.02425;
+  if (p < low || p > 1 - low) {
+    const double q = std::sqrt(-2 * std::log(p < low ? p : 1 - p));
+    const double x =
+        (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+        ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    return p < low ? x : -x;
+  }
+  const double q = p - 0.5;
+  const double r = q * q;
+  return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) *
+         q /
+         (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+}
+
+/// Mann-Kendall trend test: the normalized statistic of `n` values in
+/// chronological order. Its absolute value exceeds the normal quantile of the
+/// confidence level (1.96 for 95%) when the values trend up (positive) or
+/// down (negative); a level shift counts as a trend. Equal values, common
+/// with quantized timers, are handled with the usual tie correction of the
+/// variance. O(n^2).
+inline double trend_z_score(const double *values, size_t n) {
+  if (n < 3) {
+    return 0;
+  }
+  double s = 0;
+  // Sum of t(t - 1)(2t + 5) over the groups of t equal values, each group
+  // counted at its first value.
+  double ties = 0;
+  for (size_t i = 0; i < n; i++) {
+    bool first = true;
+    for (size_t j = 0; j < i && first; j++) {
+      first = values[j] != values[i];
+    }
+    double t = 1;
+    for (size_t j = i + 1; j < n; j++) {
+      s += values[j] > values[i] ? 1 : values[j] < values[i] ? -1 : 0;
+      t += first && values[j] == values[i] ? 1 : 0;
+    }
+    ties += t * (t - 1) * (2 * t + 5);
+  }
+  if (s == 0) {
+    return 0;
+  }
+  const double variance =
+      (double(n) * double(n - 1) * double(2 * n + 5) - ties) / 18;
+  return (s > 0 ? s - 1 : s + 1) / std::sqrt(variance);
+}
+
+/// Streaming statistics of one counter: moments and quantiles.
+struct counter_statistics {
+  running_statistics moments{};
+  quantile_sketch quantiles{};
+
+  void update(double x) {
+    moments.update(x);
+    quantiles.update(x);
+  }
+  void merge(const counter_statistics &other) {
+    moments.merge(other.moments);
+    quantiles.merge(other.quantiles);
+  }
+  void shift(double delta) {
+    moments.shift(delta);
+    quantiles.shift(delta);
+  }
+  // Subtracts `value` from every value, clamping at zero like
+  // basic_event_aggregate::subtract_overhead does for its sums and samples.
+  void subtract(double value) {
+    moments.subtract(value);
+    quantiles.subtract(value);
+  }
+  void multiply(double factor) {
+    moments.multiply(factor);
+    quantiles.multiply(factor);
+  }
+  void write(internal::byte_writer &out) const {
+    moments.write(out);
+    quantiles.write(out);
+  }
+  void read(internal::byte_reader &in) {
+    moments.read(in);
+    quantiles.read(in);
+  }
+};
+
+/// Summary of the samples of one counter, per call.
+struct sample_summary {
+  uint64_t samples = 0;
+  double mean = 0;
+  double stddev = 0;
+  /// Standard deviation of the mean: stddev / sqrt(samples).
+  double standard_error = 0;
+  double min = 0;
+  double median = 0;
+  double p90 = 0;
+  double p99 = 0;
+  double max = 0;
+  /// Median absolute deviation from the median.
+  double mad = 0;
+
+  /// Summarizes `stats`, whose values each cover `calls` calls.
+  static sample_summary from(const counter_statistics &stats, double calls) {
+    sample_summary s;
+    s.samples = stats.moments.count();
+    if (s.samples == 0) {
+      return s;
+    }
+    s.mean = stats.moments.mean() / calls;
+    s.stddev = stats.moments.stddev() / calls;
+    s.standard_error = stats.moments.standard_error() / calls;
+    s.min = stats.quantiles.min() / calls;
+    s.median = stats.quantiles.median() / calls;
+    s.p90 = stats.quantiles.quantile(0.9) / calls;
+    s.p99 = stats.quantiles.quantile(0.99) / calls;
+    s.max = stats.quantiles.max() / calls;
+    s.mad = stats.quantiles.mad() / calls;
+    return s;
+  }
+};
+
+} // namespace counters
+#endif // COUNTERS_STATISTICS_H_
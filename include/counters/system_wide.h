@@ -0,0 +1,226 @@
+#ifndef COUNTERS_SYSTEM_WIDE_H_
+#define COUNTERS_SYSTEM_WIDE_H_
+
+#include "counters/event_counter.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+namespace counters {
+
+/// Events of every task on each CPU over one window of a
+/// basic_system_collector: one count per CPU and their sum. Every count has
+/// the elapsed time of the window.
+template <class Set> struct basic_system_count {
+  /// CPU numbers, in the order of `per_cpu`.
+  std::vector<int> cpus;
+  std::vector<basic_event_count<Set>> per_cpu;
+  /// Counts summed over the CPUs; the coverage of each event is its
+  /// smallest over the CPUs.
+  basic_event_count<Set> total{};
+};
+
+namespace internal {
+// Parses a CPU list such as "0-3,8,10-11" (the format of
+// /sys/devices/system/cpu/online).
+inline std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  size_t i = 0;
+  auto number = [&list, &i]() {
+    int value = 0;
+    for (; i < list.size() && list[i] >= '0' && list[i] <= '9'; i++) {
+      value = value * 10 + (list[i] - '0');
+    }
+    return value;
+  };
+  while (i < list.size() && list[i] >= '0' && list[i] <= '9') {
+    const int first = number();
+    int last = first;
+    if (i < list.size() && list[i] == '-') {
+      i++;
+      last = number();
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+    if (i < list.size() && list[i] == ',') {
+      i++;
+    }
+  }
+  return cpus;
+}
+
+// The online CPUs, or CPUs 0 to N-1 if the list cannot be read.
+inline std::vector<int> online_cpus() {
+  std::vector<int> cpus;
+#if defined(__linux__)
+  std::ifstream file("/sys/devices/system/cpu/online");
+  std::string list;
+  if (std::getline(file, list)) {
+    cpus = parse_cpu_list(list);
+  }
+  if (cpus.empty()) {
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long cpu = 0; cpu < count; cpu++) {
+      cpus.push_back(int(cpu));
+    }
+  }
+#endif
+  return cpus;
+}
+} // namespace internal
+
+/// Counts `Events...` (event tags from events.h, or a single event_set; an
+/// empty list selects default_event_set) for every task on every online
+/// CPU, not just the calling thread: e.g. to see the memory traffic or
+/// cache misses that co-located jobs add while a benchmark runs. One event
+/// group is opened per CPU (perf_event_open with pid -1), and end() reads
+/// the groups one after the other with the same group read as
+/// event_collector:
+///
+///   counters::system_collector machine;
+///   machine.start();
+///   auto agg = counters::bench(kernel);
+///   const auto &window = machine.end();
+///   for (size_t i = 0; i < window.cpus.size(); i++) {
+///     printf("cpu %d: %.0f cache misses\n", window.cpus[i],
+///            window.per_cpu[i].cache_misses());
+///   }
+///
+/// Only user-space events are counted, as with event_collector. Counting
+/// per CPU needs perf_event_paranoid at 0 or below, or CAP_PERFMON; when
+/// the groups cannot be opened, has_events() is false, end() reports no
+/// CPUs and unavailable_reason() says why. Of the collector options, only
+/// `scheduling` applies; the window is timed with steady_clock.
+template <class... Events> class basic_system_collector {
+public:
+  using event_set_type = event_set_t<Events...>;
+  using count_type = basic_system_count<event_set_type>;
+  static_assert(!event_set_type::is_runtime,
+                "system-wide counting needs a static event set");
+
+  explicit basic_system_collector(
+      const collector_options &opts = collector_options()) {
+#if defined(__linux__)
+    std::vector<perf_event_config> configs;
+    for (event_kind kind : event_set_type::kinds) {
+      configs.push_back(perf_config_for(kind));
+    }
+    int error = 0;
+    for (int cpu : internal::online_cpus()) {
+      perf_event_options target;
+      target.scheduling = opts.scheduling;
+      target.pid = -1;
+      target.cpu = cpu;
+      LinuxEvents<PERF_TYPE_HARDWARE> group(configs, target);
+      if (!group.is_working()) {
+        error = group.open_error();
+        continue;
+      }
+      cpus.push_back(cpu);
+      groups.push_back(std::move(group));
+    }
+    if (groups.empty()) {
+      reason = describe(error);
+    }
+#else
+    (void)opts;
+    reason = "system-wide counting needs Linux perf events";
+#endif
+    result.cpus = cpus;
+    result.per_cpu.resize(cpus.size());
+  }
+
+  /// Whether the events are counted on at least one CPU.
+  bool has_events() const { return !cpus.empty(); }
+  /// Why nothing is counted when has_events() is false, empty otherwise.
+  const std::string &unavailable_reason() const { return reason; }
+  /// The CPUs that are counted.
+  const std::vector<int> &counted_cpus() const { return cpus; }
+  size_t pass_count() const {
+#if defined(__linux__)
+    return groups.empty() ? 1 : groups.front().pass_count();
+#else
+    return 1;
+#endif
+  }
+  /// With event_scheduling::multi_pass, selects the pass on every CPU.
+  void select_pass(size_t pass) {
+#if defined(__linux__)
+    for (auto &group : groups) {
+      group.select_pass(pass);
+    }
+#else
+    (void)pass;
+#endif
+  }
+
+  void start() {
+#if defined(__linux__)
+    for (auto &group : groups) {
+      group.start();
+    }
+#endif
+    start_clock = std::chrono::steady_clock::now();
+  }
+
+  /// Reads every CPU and returns the counts of the window since start().
+  const count_type &end() {
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_clock;
+    result.total = basic_event_count<event_set_type>{};
+    if (cpus.empty()) {
+      result.total.coverage.fill(0);
+    }
+#if defined(__linux__)
+    for (size_t i = 0; i < groups.size(); i++) {
+      basic_event_count<event_set_type> &count = result.per_cpu[i];
+      groups[i].end(count.event_counts.data(), count.coverage.data());
+      count.elapsed = elapsed;
+      result.total += count;
+    }
+#endif
+    result.total.elapsed = elapsed;
+    return result;
+  }
+
+private:
+  std::vector<int> cpus;
+  std::string reason;
+  count_type result;
+  std::chrono::time_point<std::chrono::steady_clock> start_clock{};
+#if defined(__linux__)
+  std::vector<LinuxEvents<PERF_TYPE_HARDWARE>> groups;
+
+  static std::string describe(int error) {
+    if (error == EACCES || error == EPERM) {
+      return "per-CPU counting is not permitted: perf_event_paranoid is " +
+             std::to_string(perf_event_paranoid()) +
+             " (it must be 0 or less, or the process needs CAP_PERFMON)";
+    }
+    if (error == ENOENT || error == EOPNOTSUPP || error == ENODEV) {
+      return std::string("the events are not supported on this machine: ") +
+             std::strerror(error);
+    }
+    if (error == 0) {
+      return "no event could be scheduled on any CPU";
+    }
+    return std::string("perf_event_open failed: ") + std::strerror(error);
+  }
+#endif
+};
+
+using system_collector = basic_system_collector<>;
+
+} // namespace counters
+#endif // COUNTERS_SYSTEM_WIDE_H_
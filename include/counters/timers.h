@@ -0,0 +1,211 @@
+#ifndef COUNTERS_TIMERS_H_
+#define COUNTERS_TIMERS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+namespace counters {
+
+/// How a collector timestamps its samples.
+enum class timer_backend : uint8_t {
+  /// std::chrono::steady_clock: portable, but each reading goes through the
+  /// vDSO (or a system call) and a conversion.
+  steady_clock,
+  /// The processor's constant-rate cycle counter: the time-stamp counter
+  /// (`rdtsc`/`rdtscp`) on x86, `cntvct_el0` on 64-bit ARM. A few
+  /// nanoseconds per reading. Falls back to steady_clock when the counter is
+  /// not usable (see cycle_counter_available()).
+  cycle_counter,
+};
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) ||            \
+    defined(_M_IX86)
+#define COUNTERS_X86_CYCLE_COUNTER 1
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+#define COUNTERS_ARM_CYCLE_COUNTER 1
+#endif
+
+/// Reads the cycle counter at the start of a measured region.
+inline uint64_t read_cycle_counter() {
+#if defined(COUNTERS_X86_CYCLE_COUNTER) && defined(_MSC_VER)
+  return __rdtsc();
+#elif defined(COUNTERS_X86_CYCLE_COUNTER)
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (uint64_t(hi) << 32) | lo;
+#elif defined(COUNTERS_ARM_CYCLE_COUNTER)
+  uint64_t value;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+  return value;
+#else
+  return 0;
+#endif
+}
+
+/// Reads the cycle counter at the end of a measured region. On x86 this is
+/// `rdtscp`, which waits for the preceding instructions to execute.
+inline uint64_t read_cycle_counter_end() {
+#if defined(COUNTERS_X86_CYCLE_COUNTER) && defined(_MSC_VER)
+  unsigned int aux;
+  return __rdtscp(&aux);
+#elif defined(COUNTERS_X86_CYCLE_COUNTER)
+  uint32_t lo, hi, aux;
+  __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+  return (uint64_t(hi) << 32) | lo;
+#else
+  return read_cycle_counter();
+#endif
+}
+
+/// Barriers that keep the measured code from overlapping with the timer and
+/// counter reads in out-of-order processors.
+enum class measurement_fence : uint8_t {
+  /// No barrier: the cheapest, but the processor may start the measured code
+  /// before the start reads complete, or finish it after the end reads.
+  none,
+  /// `lfence` on x86, `isb` on 64-bit ARM: later instructions do not start
+  /// before the earlier ones have completed. Costs a few dozen cycles.
+  execution,
+  /// `cpuid` on x86 (fully serializing, also drains the store buffer),
+  /// `dsb sy` plus `isb` on 64-bit ARM. Much more expensive, and `cpuid`
+  /// traps to the hypervisor in a virtual machine.
+  full,
+};
+
+namespace internal {
+#if defined(COUNTERS_X86_CYCLE_COUNTER)
+inline void cpuid(uint32_t leaf, uint32_t regs[4]) {
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, int(leaf));
+  for (int i = 0; i < 4; i++) {
+    regs[i] = uint32_t(info[i]);
+  }
+#else
+  __asm__ volatile("cpuid"
+                   : "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+                   : "a"(leaf), "c"(0)
+                   : "memory");
+#endif
+}
+
+// The TSC ticks at a constant rate, in every power state, only when the
+// processor reports an invariant TSC (CPUID 0x80000007, EDX bit 8) and
+// supports rdtscp (CPUID 0x80000001, EDX bit 27).
+inline bool invariant_tsc() {
+  uint32_t regs[4];
+  cpuid(0x80000000, regs);
+  if (regs[0] < 0x80000007) {
+    return false;
+  }
+  cpuid(0x80000001, regs);
+  const bool has_rdtscp = (regs[3] >> 27) & 1;
+  cpuid(0x80000007, regs);
+  return has_rdtscp && ((regs[3] >> 8) & 1);
+}
+#endif
+
+// Nanoseconds of the most precise monotonic clock that is not slewed by NTP.
+inline uint64_t raw_monotonic_ns() {
+#if defined(CLOCK_MONOTONIC_RAW)
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+#else
+  return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count());
+#endif
+}
+
+// Counts cycle-counter ticks over about 20 ms of the raw monotonic clock.
+inline double calibrate_cycle_counter() {
+  const uint64_t start_ns = raw_monotonic_ns();
+  const uint64_t start_ticks = read_cycle_counter();
+  uint64_t end_ns;
+  do {
+    end_ns = raw_monotonic_ns();
+  } while (end_ns - start_ns < 20000000);
+  const uint64_t end_ticks = read_cycle_counter();
+  return double(end_ticks - start_ticks) * 1e9 / double(end_ns - start_ns);
+}
+
+struct cycle_counter_properties {
+  bool available = false;
+  double frequency = 0; // Hz
+};
+
+inline cycle_counter_properties probe_cycle_counter() {
+  cycle_counter_properties properties;
+#if defined(COUNTERS_X86_CYCLE_COUNTER)
+  properties.available = invariant_tsc();
+  if (properties.available) {
+    properties.frequency = calibrate_cycle_counter();
+  }
+#elif defined(COUNTERS_ARM_CYCLE_COUNTER)
+  // The generic timer is architectural and runs at a constant rate.
+  uint64_t frequency;
+  __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+  properties.available = frequency != 0;
+  properties.frequency = double(frequency);
+#endif
+  return properties;
+}
+
+inline const cycle_counter_properties &cycle_counter() {
+  static const cycle_counter_properties properties = probe_cycle_counter();
+  return properties;
+}
+} // namespace internal
+
+/// True if the cycle counter runs at a constant rate and can be read from
+/// user space, so that timer_backend::cycle_counter can be used. The first
+/// call also determines the counter's frequency: on x86 it is calibrated
+/// against CLOCK_MONOTONIC_RAW, which takes about 20 ms; on ARM it is read
+/// from `cntfrq_el0`.
+inline bool cycle_counter_available() {
+  return internal::cycle_counter().available;
+}
+
+/// Frequency of the cycle counter in Hz, 0 when it is not available.
+inline double cycle_counter_frequency() {
+  return internal::cycle_counter().frequency;
+}
+
+/// Executes the barrier `kind`; a no-op on other architectures.
+inline void fence(measurement_fence kind) {
+  if (kind == measurement_fence::none) {
+    return;
+  }
+#if defined(COUNTERS_X86_CYCLE_COUNTER)
+  if (kind == measurement_fence::full) {
+    uint32_t regs[4];
+    internal::cpuid(0, regs);
+  } else {
+#if defined(_MSC_VER)
+    _mm_lfence();
+#else
+    __asm__ volatile("lfence" ::: "memory");
+#endif
+  }
+#elif defined(COUNTERS_ARM_CYCLE_COUNTER)
+  if (kind == measurement_fence::full) {
+    __asm__ volatile("dsb sy" ::: "memory");
+  }
+  __asm__ volatile("isb" ::: "memory");
+#endif
+}
+
+/// Converts a difference of cycle-counter readings to seconds.
+inline std::chrono::duration<double> cycle_counter_duration(uint64_t ticks) {
+  return std::chrono::duration<double>(double(ticks) /
+                                       cycle_counter_frequency());
+}
+
+} // namespace counters
+#endif // COUNTERS_TIMERS_H_
@@ -0,0 +1,207 @@
+#ifndef COUNTERS_TOPDOWN_H_
+#define COUNTERS_TOPDOWN_H_
+#ifdef __linux__
+
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include "counters/bench.h"
+
+namespace counters {
+
+/// Where a top-down breakdown comes from.
+enum class topdown_method : uint8_t {
+  /// The top-down (TMA) events of the core PMU: `slots` and `topdown-*`,
+  /// published in sysfs by recent Intel processors. Exact level 1, and level
+  /// 2 when the processor provides the level-2 events.
+  slots,
+  /// The generic stalled-cycles-frontend and stalled-cycles-backend events,
+  /// relative to cycles. Only frontend and backend bound are measured;
+  /// retiring is what remains and includes bad speculation.
+  stalled_cycles,
+  /// Neither set of events could be counted.
+  unavailable,
+};
+
+constexpr const char *topdown_method_name(topdown_method method) {
+  switch (method) {
+  case topdown_method::slots: return "slots";
+  case topdown_method::stalled_cycles: return "stalled-cycles";
+  case topdown_method::unavailable: return "unavailable";
+  }
+  return "unknown";
+}
+
+/// Top-down microarchitecture analysis of a benchmark: the fraction of the
+/// pipeline slots (or of the cycles, with topdown_method::stalled_cycles)
+/// that went to each category. Fractions that could not be measured are NaN.
+struct topdown_breakdown {
+  topdown_method method = topdown_method::unavailable;
+  // Level 1; with topdown_method::slots the four categories add up to one.
+  double frontend_bound = std::numeric_limits<double>::quiet_NaN();
+  double bad_speculation = std::numeric_limits<double>::quiet_NaN();
+  double retiring = std::numeric_limits<double>::quiet_NaN();
+  double backend_bound = std::numeric_limits<double>::quiet_NaN();
+  // Level 2, when has_level2 is set; each pair adds up to its level-1 parent.
+  bool has_level2 = false;
+  double fetch_latency = std::numeric_limits<double>::quiet_NaN();
+  double fetch_bandwidth = std::numeric_limits<double>::quiet_NaN();
+  double branch_mispredicts = std::numeric_limits<double>::quiet_NaN();
+  double machine_clears = std::numeric_limits<double>::quiet_NaN();
+  double heavy_operations = std::numeric_limits<double>::quiet_NaN();
+  double light_operations = std::numeric_limits<double>::quiet_NaN();
+  double memory_bound = std::numeric_limits<double>::quiet_NaN();
+  double core_bound = std::numeric_limits<double>::quiet_NaN();
+  // Instructions per cycle, NaN when either event is missing.
+  double ipc = std::numeric_limits<double>::quiet_NaN();
+};
+
+namespace internal {
+// Events of topdown_method::slots. The kernel requires `slots` to lead the
+// group, so it comes first; cycles and instructions, only needed for the
+// IPC, come last so that they are the ones dropped when the PMU is full.
+constexpr const char *topdown_slot_events[] = {
+    "slots",           "topdown-retiring",      "topdown-bad-spec",
+    "topdown-fe-bound", "topdown-be-bound",     "topdown-heavy-ops",
+    "topdown-br-mispredict", "topdown-fetch-lat", "topdown-mem-bound"};
+constexpr const char *topdown_stall_events =
+    "cycles,instructions,stalled-cycles-frontend,stalled-cycles-backend";
+
+template <class Aggregate>
+double topdown_count(const event_list &events, const Aggregate &aggregate,
+                     const char *name) {
+  const size_t i = events.index_of(name);
+  if (i == event_list::npos ||
+      aggregate.confidence(i) == count_confidence::missing) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  return aggregate.get(i);
+}
+} // namespace internal
+
+/// The events needed for a top-down analysis on this system: the TMA events
+/// when `catalog` (default: pmu_catalog::system()) publishes them, the
+/// generic stalled-cycles events otherwise. With `level1_only`, the level-2
+/// events are left out, leaving more room on the PMU.
+inline event_list topdown_events(const pmu_catalog *catalog = nullptr,
+                                 bool level1_only = false) {
+  const pmu_catalog &pmus =
+      catalog != nullptr ? *catalog : pmu_catalog::system();
+  if (pmus.find("", "slots") == nullptr ||
+      pmus.find("", "topdown-retiring") == nullptr) {
+    return event_list::parse(internal::topdown_stall_events);
+  }
+  event_list list;
+  const size_t count = level1_only ? 5 : 9; // slots and level 1 come first
+  for (size_t i = 0; i < count; i++) {
+    const char *name = internal::topdown_slot_events[i];
+    if (const pmu_event *event = pmus.find("", name)) {
+      list.add(name, event->config);
+    }
+  }
+  list.add("cycles").add("instructions");
+  return list;
+}
+
+/// Computes the breakdown from a measurement of `events` (as returned by
+/// topdown_events()). Uses the TMA events when they were counted, and the
+/// stalled-cycles events otherwise.
+template <class Aggregate>
+topdown_breakdown topdown_analyze(const event_list &events,
+                                  const Aggregate &aggregate) {
+  auto count = [&](const char *name) {
+    return internal::topdown_count(events, aggregate, name);
+  };
+  auto known = [](double value) { return value == value; }; // not NaN
+  topdown_breakdown result;
+  const double cycles = count("cycles");
+  result.ipc = count("instructions") / cycles;
+  const double slots = count("slots");
+  const double retiring = count("topdown-retiring");
+  const double bad_spec = count("topdown-bad-spec");
+  const double fe = count("topdown-fe-bound");
+  const double be = count("topdown-be-bound");
+  if (known(slots) && slots > 0 && known(retiring) && known(bad_spec) &&
+      known(fe) && known(be)) {
+    result.method = topdown_method::slots;
+    result.retiring = retiring / slots;
+    result.bad_speculation = bad_spec / slots;
+    result.frontend_bound = fe / slots;
+    result.backend_bound = be / slots;
+    const double heavy = count("topdown-heavy-ops");
+    const double mispredict = count("topdown-br-mispredict");
+    const double fetch_lat = count("topdown-fetch-lat");
+    const double mem = count("topdown-mem-bound");
+    if (known(heavy) && known(mispredict) && known(fetch_lat) && known(mem)) {
+      result.has_level2 = true;
+      result.heavy_operations = heavy / slots;
+      result.light_operations = result.retiring - result.heavy_operations;
+      result.branch_mispredicts = mispredict / slots;
+      result.machine_clears =
+          result.bad_speculation - result.branch_mispredicts;
+      result.fetch_latency = fetch_lat / slots;
+      result.fetch_bandwidth = result.frontend_bound - result.fetch_latency;
+      result.memory_bound = mem / slots;
+      result.core_bound = result.backend_bound - result.memory_bound;
+    }
+    return result;
+  }
+  const double stalled_fe = count("stalled-cycles-frontend");
+  const double stalled_be = count("stalled-cycles-backend");
+  if (!known(cycles) || cycles <= 0 ||
+      (!known(stalled_fe) && !known(stalled_be))) {
+    return result;
+  }
+  result.method = topdown_method::stalled_cycles;
+  result.frontend_bound = stalled_fe / cycles;
+  result.backend_bound = stalled_be / cycles;
+  if (known(stalled_fe) && known(stalled_be)) {
+    const double rest = 1 - result.frontend_bound - result.backend_bound;
+    result.retiring = rest > 0 ? rest : 0;
+  }
+  return result;
+}
+
+/// Result of bench_topdown(): the events that were counted, their
+/// measurement and the breakdown computed from it.
+template <size_t Capacity = 32> struct topdown_result {
+  event_list events;
+  basic_event_aggregate<runtime_event_set<Capacity>> aggregate;
+  topdown_breakdown breakdown;
+};
+
+/// Benchmarks `function` and reports its top-down breakdown, e.g.
+///
+///   auto r = counters::bench_topdown([] { /* ... */ });
+///   if (r.breakdown.method != counters::topdown_method::unavailable)
+///     printf("backend bound: %.1f%%\n", 100 * r.breakdown.backend_bound);
+///
+/// The TMA events are tried first. When they are not published or cannot be
+/// counted (e.g. in a virtual machine), the benchmark is rerun with the
+/// stalled-cycles events. The TMA events must be read as one group, so
+/// `params.collector` is ignored for them.
+template <class Function>
+topdown_result<> bench_topdown(Function &&function,
+                               const bench_parameter &params = bench_parameter(),
+                               const pmu_catalog *catalog = nullptr) {
+  topdown_result<> result{topdown_events(catalog), {}, {}};
+  if (result.events.index_of("slots") != event_list::npos) {
+    bench_parameter grouped = params;
+    grouped.collector = collector_options();
+    result.aggregate = bench(result.events, function, grouped);
+    result.breakdown = topdown_analyze(result.events, result.aggregate);
+    if (result.breakdown.method == topdown_method::slots) {
+      return result;
+    }
+    result.events = event_list::parse(internal::topdown_stall_events);
+  }
+  result.aggregate = bench(result.events, function, params);
+  result.breakdown = topdown_analyze(result.events, result.aggregate);
+  return result;
+}
+
+} // namespace counters
+
+#endif // __linux__
+#endif // COUNTERS_TOPDOWN_H_
@@ -0,0 +1,65 @@
+#include "counters/attach.h"
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  if (!condition) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+int main() {
+  const std::vector<int> own = counters::internal::task_ids(getpid());
+  check(own.size() == 1 && own.front() == getpid(), "task enumeration");
+
+  // A forked child that spins until it is killed.
+  const pid_t child = fork();
+  if (child == 0) {
+    volatile unsigned long sink = 0;
+    for (;;) sink = sink + 1;
+  }
+  check(child > 0, "fork");
+
+  counters::attached_collector attached(child, true);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  const auto &first = attached.snapshot();
+  check(first.total.elapsed_ns() >= 50e6, "snapshots are timed");
+  check(first.threads == attached.counted_threads() &&
+            first.per_thread.size() == first.threads.size(),
+        "one count per counted thread");
+  if (attached.has_events()) {
+    check(first.threads == std::vector<int>({child}), "the child's thread");
+    const double before = first.total.instructions();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    const auto &second = attached.snapshot();
+    printf("child: %.0f then %.0f instructions\n", before,
+           second.total.instructions());
+    check(before > 0 && second.total.instructions() > 0,
+          "each snapshot counts the child's work since the previous one");
+  } else {
+    printf("attaching unavailable: %s\n", attached.unavailable_reason().c_str());
+    check(!attached.unavailable_reason().empty(), "a reason is given");
+  }
+  kill(child, SIGKILL);
+  waitpid(child, nullptr, 0);
+
+  counters::attached_collector gone(child);
+  check(!gone.has_events() && !gone.unavailable_reason().empty(),
+        "a process that is gone cannot be attached");
+
+  if (failures != 0) {
+    return EXIT_FAILURE;
+  }
+  printf("attach tests passed\n");
+  return EXIT_SUCCESS;
+}
@@ -1,5 +1,11 @@
 #include "counters/bench.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
+#include <ctime>
+#include <thread>
+#include <vector>
 
 volatile int sink = 0;
 
@@ -19,6 +25,15 @@ int main() {
   printf("trivial: elapsed_ns=%f total_ns=%f iterations=%d instructions=%f branches=%f branch_misses=%f cache_misses=%f\n",
          trivial_simple.elapsed_ns(), trivial_simple.total_elapsed_ns(), trivial_simple.iteration_count(), trivial_simple.instructions(), trivial_simple.branches(), trivial_simple.branch_misses(), trivial_simple.cache_misses());
 
+  // Same, with the calibrated cost of start()/end() subtracted from each sample
+  counters::bench_parameter p_overhead;
+  p_overhead.subtract_overhead = true;
+  auto trivial_corrected = counters::bench([] {  }, p_overhead);
+  printf("trivial (overhead subtracted): elapsed_ns=%f instructions=%f overhead: elapsed_ns=%f instructions=%f cycles=%f (%zu samples)\n",
+         trivial_corrected.elapsed_ns(), trivial_corrected.instructions(),
+         trivial_corrected.overhead.elapsed_ns(), trivial_corrected.overhead.get<counters::events::instructions>(),
+         trivial_corrected.overhead.get<counters::events::cycles>(), trivial_corrected.overhead.samples);
+
   // Default measurement for a very simple function
   auto agg_simple = counters::bench([] { sink++; });
   printf("simple: elapsed_ns=%f total_ns=%f iterations=%d instructions=%f branches=%f branch_misses=%f cache_misses=%f\n",
@@ -35,6 +50,339 @@ int main() {
   printf("fancy: elapsed_ns=%f total_ns=%f iterations=%d instructions=%f branches=%f branch_misses=%f cache_misses=%f\n",
          agg_fancy.elapsed_ns(), agg_fancy.total_elapsed_ns(), agg_fancy.iteration_count(), agg_fancy.instructions(), agg_fancy.branches(), agg_fancy.branch_misses(), agg_fancy.cache_misses());
 
+  // Same workload, reading the counters from user space (rdpmc on Linux)
+  counters::bench_parameter p_user = p;
+  p_user.collector.user_space_read = true;
+  auto agg_user = counters::bench([] {
+    volatile int s = 0;
+    for (int i = 0; i < 100; ++i) s += i;
+    sink += s;
+  }, p_user);
+  printf("fancy (user-space read): elapsed_ns=%f total_ns=%f iterations=%d instructions=%f branches=%f branch_misses=%f cache_misses=%f\n",
+         agg_user.elapsed_ns(), agg_user.total_elapsed_ns(), agg_user.iteration_count(), agg_user.instructions(), agg_user.branches(), agg_user.branch_misses(), agg_user.cache_misses());
+#if defined(__linux__)
+  // Where rdpmc is allowed, the user-space reads count exactly and agree
+  // with the read() system calls.
+  counters::event_collector user_reader(p_user.collector);
+  if (user_reader.linux_events.user_read_available()) {
+    const double syscall_instructions = agg_fancy.instructions();
+    if (agg_user.confidence<counters::events::instructions>() != counters::count_confidence::exact ||
+        std::fabs(agg_user.instructions() - syscall_instructions) > 0.1 * syscall_instructions + 50) {
+      printf("FAILED: user-space read of %f instructions, %f with read()\n",
+             agg_user.instructions(), syscall_instructions);
+      return EXIT_FAILURE;
+    }
+  } else {
+    printf("user-space read: rdpmc is not available, compared nothing\n");
+  }
+#endif
+
+  // Compile-time event selection: count only the events we need
+  auto agg_events = counters::bench<counters::events::cycles,
+                                    counters::events::instructions,
+                                    counters::events::l1d_misses,
+                                    counters::events::page_faults>([] {
+    volatile int s = 0;
+    for (int i = 0; i < 100; ++i) s += i;
+    sink += s;
+  }, p);
+  printf("fancy (selected events): elapsed_ns=%f cycles=%f instructions=%f l1d_misses=%f page_faults=%f\n",
+         agg_events.elapsed_ns(), agg_events.get<counters::events::cycles>(), agg_events.get<counters::events::instructions>(),
+         agg_events.get<counters::events::l1d_misses>(), agg_events.get<counters::events::page_faults>());
+  // Only the selected events are opened, and each reads from its own slot:
+  // the software task clock sits between two hardware events.
+  using selection = counters::event_set<counters::events::cycles, counters::events::task_clock,
+                                        counters::events::instructions>;
+  counters::basic_event_collector<selection> selected;
+#if defined(__linux__)
+  if (selected.linux_configs.size() != selection::size || selected.linux_events.event_count() > selection::size ||
+      selected.linux_configs[1] != counters::perf_config_for(counters::event_kind::task_clock)) {
+    printf("FAILED: the collector opens the selected events only\n");
+    return EXIT_FAILURE;
+  }
+#endif
+  counters::basic_sample_arena<selection> selected_samples(p.max_repeat);
+  auto agg_selected = counters::bench<selection>([] { volatile int x = fib(15); (void)x; }, p,
+                                                 selected_samples);
+  for (size_t i = 0; i < selection::size; i++) {
+    unsigned long long sum = 0;
+    for (unsigned long long value : selected_samples.counts_of(i)) {
+      sum += value;
+    }
+    if (sum != agg_selected.total.event_counts[i]) {
+      printf("FAILED: arena counts of event %zu\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+  const auto clock_samples = selected_samples.counts_of<counters::events::task_clock>();
+  if (clock_samples.data() != selected_samples.counts_of(1).data() ||
+      (agg_selected.confidence<counters::events::task_clock>() == counters::count_confidence::exact &&
+       std::count(clock_samples.begin(), clock_samples.end(), 0ull) != 0)) {
+    printf("FAILED: counts_of<task_clock> reads the second slot\n");
+    return EXIT_FAILURE;
+  }
+
+  // Same workload, timestamped with the cycle counter (rdtsc, cntvct_el0)
+  counters::bench_parameter p_tsc = p;
+  p_tsc.collector.timer = counters::timer_backend::cycle_counter;
+  auto agg_tsc = counters::bench([] {
+    volatile int s = 0;
+    for (int i = 0; i < 100; ++i) s += i;
+    sink += s;
+  }, p_tsc);
+  printf("fancy (cycle counter at %.0f Hz%s): elapsed_ns=%f total_ns=%f iterations=%d instructions=%f\n",
+         counters::cycle_counter_frequency(), counters::cycle_counter_available() ? "" : ", unavailable",
+         agg_tsc.elapsed_ns(), agg_tsc.total_elapsed_ns(), agg_tsc.iteration_count(), agg_tsc.instructions());
+  if (counters::cycle_counter_available()) {
+    // Both timers on alternating samples of the same work.
+    counters::basic_event_collector<counters::events::task_clock> tsc_timed(p_tsc.collector);
+    counters::basic_event_collector<counters::events::task_clock> clock_timed(p.collector);
+    decltype(tsc_timed)::aggregate_type by_tsc, by_clock;
+    for (int sample = 0; sample < 200; sample++) {
+      tsc_timed.start();
+      sink += fib(18);
+      by_tsc << tsc_timed.end();
+      clock_timed.start();
+      sink += fib(18);
+      by_clock << clock_timed.end();
+    }
+    const double tsc_ns = by_tsc.elapsed_summary().median;
+    const double clock_ns = by_clock.elapsed_summary().median;
+    printf("fib18 timed with the cycle counter: %f ns, with steady_clock: %f ns\n", tsc_ns, clock_ns);
+    if (!(counters::cycle_counter_frequency() > 0) || !tsc_timed.uses_cycle_counter() ||
+        tsc_ns < clock_ns / 2 || tsc_ns > clock_ns * 2) {
+      printf("FAILED: cycle counter timing\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Precise mode: fences around the reads, with their cost reported apart
+  counters::bench_parameter p_precise = p_tsc;
+  p_precise.collector.fence = counters::measurement_fence::execution;
+  p_precise.subtract_overhead = true;
+  auto agg_precise = counters::bench([] {
+    volatile int s = 0;
+    for (int i = 0; i < 100; ++i) s += i;
+    sink += s;
+  }, p_precise);
+  printf("fancy (precise, overhead subtracted): elapsed_ns=%f instructions=%f overhead_ns=%f of which fences=%f\n",
+         agg_precise.elapsed_ns(), agg_precise.instructions(), agg_precise.overhead.elapsed_ns(),
+         agg_precise.overhead.fence.elapsed_ns());
+  if (agg_precise.overhead.samples == 0 || !(agg_precise.overhead.fence.elapsed_ns() >= 0) ||
+      agg_precise.overhead.fence.elapsed_ns() > agg_precise.overhead.elapsed_ns()) {
+    printf("FAILED: the fence cost is part of the overhead\n");
+    return EXIT_FAILURE;
+  }
+
+  // Keep every event and scale multiplexed counts instead of dropping events
+  counters::bench_parameter p_mux = p;
+  p_mux.collector.scheduling = counters::event_scheduling::multiplex;
+  auto agg_mux = counters::bench([] {
+    volatile int s = 0;
+    for (int i = 0; i < 100; ++i) s += i;
+    sink += s;
+  }, p_mux);
+  const char *confidence_names[] = {"exact", "scaled", "missing"};
+  printf("fancy (multiplexed): elapsed_ns=%f instructions=%f (%s) cache_misses=%f (%s)\n",
+         agg_mux.elapsed_ns(), agg_mux.instructions(),
+         confidence_names[int(agg_mux.confidence<counters::events::instructions>())],
+         agg_mux.cache_misses(),
+         confidence_names[int(agg_mux.confidence<counters::events::cache_misses>())]);
+  // Every event that the group counts is counted when multiplexed, and a
+  // software event, never descheduled, counts the same in both modes.
+  auto agg_group = counters::bench([] {
+    volatile int s = 0;
+    for (int i = 0; i < 100; ++i) s += i;
+    sink += s;
+  }, p);
+  for (size_t i = 0; i < agg_mux.max_coverage.size(); i++) {
+    if (agg_mux.max_coverage[i] > 1 ||
+        (agg_group.max_coverage[i] > 0 && agg_mux.max_coverage[i] <= 0)) {
+      printf("FAILED: multiplexed coverage of event %zu is %f\n", i,
+             double(agg_mux.max_coverage[i]));
+      return EXIT_FAILURE;
+    }
+  }
+  using task_clock = counters::events::task_clock;
+  // Interleaved sample by sample, so that both modes see the same machine.
+  counters::basic_event_collector<task_clock> clock_grouped(p.collector);
+  counters::basic_event_collector<task_clock> clock_multiplexed(p_mux.collector);
+  decltype(clock_grouped)::aggregate_type clock_group, clock_mux;
+  for (int sample = 0; sample < 200; sample++) {
+    clock_grouped.start();
+    sink += fib(22);
+    clock_group << clock_grouped.end();
+    clock_multiplexed.start();
+    sink += fib(22);
+    clock_mux << clock_multiplexed.end();
+  }
+  const double group_ns = clock_group.summary<task_clock>().median;
+  const double mux_ns = clock_mux.summary<task_clock>().median;
+  printf("fib22 task clock: %f ns in a group, %f ns multiplexed (%s)\n", group_ns,
+         mux_ns, confidence_names[int(clock_mux.confidence<task_clock>())]);
+  if (clock_group.confidence<task_clock>() != counters::count_confidence::missing &&
+      (clock_mux.confidence<task_clock>() != counters::count_confidence::exact ||
+       mux_ns < 0.8 * group_ns || mux_ns > 1.25 * group_ns)) {
+    printf("FAILED: multiplexed task clock\n");
+    return EXIT_FAILURE;
+  }
+
+  // More events than the PMU holds: count them in several exact passes
+  counters::bench_parameter p_passes = p;
+  p_passes.collector.scheduling = counters::event_scheduling::multi_pass;
+  auto agg_passes = counters::bench<
+      counters::events::cycles, counters::events::instructions,
+      counters::events::branches, counters::events::branch_misses,
+      counters::events::cache_references, counters::events::cache_misses,
+      counters::events::l1d_loads, counters::events::l1d_misses,
+      counters::events::llc_misses, counters::events::dtlb_misses,
+      counters::events::itlb_misses, counters::events::task_clock>([] {
+    volatile int s = 0;
+    for (int i = 0; i < 100; ++i) s += i;
+    sink += s;
+  }, p_passes);
+  printf("fancy (multi-pass): elapsed_ns=%f instructions=%f l1d_misses=%f dtlb_misses=%f task_clock=%f\n",
+         agg_passes.elapsed_ns(), agg_passes.instructions(),
+         agg_passes.get<counters::events::l1d_misses>(),
+         agg_passes.get<counters::events::dtlb_misses>(),
+         agg_passes.get<counters::events::task_clock>());
+
+  // Inner repeat counts are not limited to powers of ten
+  size_t calls = 0;
+  counters::call_ntimes<37>([&calls] { calls++; });
+  counters::call_ntimes_runtime([&calls] { calls++; }, 10000);
+  counters::call_ntimes_runtime([&calls] { calls++; }, 12345);
+  if (calls != 37 + 10000 + 12345) {
+    printf("FAILED: call_ntimes made %zu calls\n", calls);
+    return EXIT_FAILURE;
+  }
+  printf("simple: %d calls per sample (%zu ns target), loop overhead %f ns per sample\n",
+         agg_simple.inner_iteration_count(), p.min_time_per_inner_ns, agg_simple.loop_overhead_ns);
+  if (agg_simple.inner_iteration_count() < 1 ||
+      size_t(agg_simple.inner_iteration_count()) > p.inner_max_repeat) {
+    printf("FAILED: inner repeat count out of range\n");
+    return EXIT_FAILURE;
+  }
+
+  // A batch function runs its own loop over n elements
+  std::vector<int> values(1 << 16, 1);
+  size_t batched = 0, batch_calls = 0;
+  auto agg_batch = counters::bench_batch([&](size_t n) {
+    int s = 0;
+    for (size_t i = 0; i < n; ++i) s += values[i % values.size()];
+    sink += s;
+    batched += n;
+    batch_calls++;
+  }, p);
+  printf("batch: elapsed_ns=%f per element, %d elements per sample, instructions=%f\n",
+         agg_batch.elapsed_ns(), agg_batch.inner_iteration_count(), agg_batch.instructions());
+  if (batch_calls <= size_t(agg_batch.iteration_count()) ||
+      batched < size_t(agg_batch.iteration_count()) * size_t(agg_batch.inner_iteration_count()) ||
+      agg_batch.loop_overhead_ns != 0) {
+    printf("FAILED: bench_batch\n");
+    return EXIT_FAILURE;
+  }
+
+  // In-place sort with a fresh input per call; the setup is not measured
+  std::vector<int> unsorted(256);
+  for (size_t i = 0; i < unsorted.size(); i++) unsorted[i] = int((i * 7919) % 256);
+  std::vector<std::vector<int>> inputs;
+  bool sorted_fresh = true;
+  counters::bench_parameter p_setup = p;
+  p_setup.min_time_ns = 10'000'000;
+  for (bool pregenerate : {false, true}) {
+    p_setup.pregenerate_inputs = pregenerate;
+    auto agg_sort = counters::bench_with_setup(
+        [&](size_t count) {
+          inputs.assign(count, unsorted);
+          volatile int s = 0; // expensive setup, outside the measurement
+          for (int i = 0; i < 100000; ++i) s += i;
+        },
+        [&](size_t i) {
+          sorted_fresh = sorted_fresh && !std::is_sorted(inputs[i].begin(), inputs[i].end());
+          std::sort(inputs[i].begin(), inputs[i].end());
+        },
+        [&] { inputs.clear(); }, p_setup);
+    printf("sort 256 ints (%s): elapsed_ns=%f calls per sample=%d instructions=%f\n",
+           pregenerate ? "pregenerated inputs" : "one call per sample",
+           agg_sort.elapsed_ns(), agg_sort.inner_iteration_count(), agg_sort.instructions());
+    if (!sorted_fresh || (!pregenerate && agg_sort.inner_iteration_count() != 1)) {
+      printf("FAILED: bench_with_setup\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Pause around bookkeeping that should not be measured
+  counters::bench_parameter p_pause = p;
+  p_pause.min_time_ns = 10'000'000;
+  auto agg_paused = counters::bench_pausable([](counters::bench_state &state) {
+    volatile int s = 0;
+    for (int i = 0; i < 100; ++i) s += i;
+    state.pause();
+    for (int i = 0; i < 10000; ++i) s += i; // not measured
+    state.resume();
+    sink += s;
+  }, p_pause);
+  printf("paused: elapsed_ns=%f instructions=%f pauses per call=%f pause overhead: elapsed_ns=%f instructions=%f\n",
+         agg_paused.elapsed_ns(), agg_paused.instructions(), agg_paused.pauses_per_call,
+         agg_paused.overhead.pause.elapsed_ns(), agg_paused.overhead.pause.instructions());
+  if (agg_paused.pauses_per_call != 1 || agg_paused.overhead.pause_samples == 0 ||
+      agg_paused.elapsed_ns() > 10 * agg_fancy.elapsed_ns() + agg_paused.overhead.pause.elapsed_ns()) {
+    printf("FAILED: bench_pausable\n");
+    return EXIT_FAILURE;
+  }
+
+#if defined(__linux__)
+  // Inherited counters: the work of a thread started in each sample is
+  // counted in that sample only. task_clock is a software event, so this
+  // runs without a PMU. The thread spins for 2 ms of its own CPU time, which
+  // preemption does not shorten.
+  counters::collector_options inherit;
+  inherit.inherit = true;
+  counters::basic_event_collector<task_clock> spawning(inherit);
+  auto spin_in_thread = [] {
+    std::thread child([] {
+      timespec now{};
+      do {
+        sink = sink + 1;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+      } while (now.tv_sec == 0 && now.tv_nsec < 2'000'000);
+    });
+    child.join();
+  };
+  if (spawning.has_events()) {
+    std::vector<double> children_ms;
+    for (int sample = 0; sample < 8; sample++) {
+      spawning.start();
+      spin_in_thread();
+      const double all = spawning.end().get<task_clock>();
+      const double own = spawning.calling_thread_count().get<task_clock>();
+      children_ms.push_back((all - own) / 1e6);
+    }
+    const auto range = std::minmax_element(children_ms.begin(), children_ms.end());
+    printf("inherit: children's task clock per sample between %.2f and %.2f ms\n",
+           *range.first, *range.second);
+    if (*range.first < 1.5 || *range.second > 2 * *range.first + 1) {
+      printf("FAILED: inherited counts are per sample\n");
+      return EXIT_FAILURE;
+    }
+    counters::bench_parameter p_inherit;
+    p_inherit.collector.inherit = true;
+    p_inherit.min_repeat = 3;
+    p_inherit.max_repeat = 10;
+    p_inherit.min_time_ns = 10'000'000;
+    auto agg_spawning = counters::bench<task_clock>(spin_in_thread, p_inherit);
+    const double children = agg_spawning.children<task_clock>() / 1e6;
+    printf("inherit: %.2f ms per call in the children over %d samples\n", children,
+           agg_spawning.iteration_count());
+    if (children < 1.5 || children > 4 ||
+        agg_spawning.calling_thread_confidence<task_clock>() != counters::count_confidence::exact) {
+      printf("FAILED: bench with inherited counters\n");
+      return EXIT_FAILURE;
+    }
+  }
+#endif
+
   // A more expensive (CPU-bound) function
   auto agg_fib = bench([] { volatile int x = fib(20); (void)x; }, p);
   printf("fib20: elapsed_ns=%f total_ns=%f iterations=%d instructions=%f branches=%f branch_misses=%f cache_misses=%f\n",
@@ -0,0 +1,188 @@
+#include "counters/bench.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#if defined(__linux__)
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  if (!condition) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+static bool has_config(const counters::event_list &list, size_t i,
+                       uint32_t type, uint64_t config) {
+  return list.configs()[i].type == type && list.configs()[i].config == config;
+}
+
+static void write_file(const std::string &path, const char *contents) {
+  std::ofstream(path) << contents << "\n";
+}
+
+// Builds a small sysfs-like tree: a core PMU "cpu" of type 4 with a split
+// offcore field, and an uncore PMU that also publishes "topdown-slots".
+static std::string make_fake_sysfs() {
+  char root[] = "/tmp/counters-sysfs-XXXXXX";
+  if (mkdtemp(root) == nullptr) {
+    return "";
+  }
+  const std::string base = root;
+  for (const char *dir : {"/cpu", "/cpu/format", "/cpu/events", "/uncore",
+                          "/uncore/format", "/uncore/events", "/broken"}) {
+    mkdir((base + dir).c_str(), 0700);
+  }
+  write_file(base + "/cpu/type", "4");
+  write_file(base + "/cpu/format/event", "config:0-7");
+  write_file(base + "/cpu/format/umask", "config:8-15");
+  write_file(base + "/cpu/format/edge", "config:18");
+  write_file(base + "/cpu/format/cmask", "config:24-31");
+  write_file(base + "/cpu/format/offcore", "config1:0-7,32-35");
+  write_file(base + "/cpu/events/topdown-slots", "event=0x00,umask=0x4");
+  write_file(base + "/cpu/events/topdown-slots.scale", "1");
+  write_file(base + "/cpu/events/cycle-activity.stalls-mem",
+             "event=0xa3,umask=0x14,cmask=0x14");
+  write_file(base + "/cpu/events/mem-stalls", "event=0xa3,umask=0x14,cmask=20");
+  write_file(base + "/cpu/events/unsupported", "event=0x1,period=1000");
+  write_file(base + "/uncore/type", "17");
+  write_file(base + "/uncore/format/event", "config:0-7");
+  write_file(base + "/uncore/events/topdown-slots", "event=0x2");
+  write_file(base + "/uncore/events/clockticks", "event=0xff");
+  return base;
+}
+
+static int remove_entry(const char *path, const struct stat *, int,
+                        struct FTW *) {
+  return remove(path);
+}
+
+static void test_pmu_catalog() {
+  const std::string root = make_fake_sysfs();
+  check(!root.empty(), "fake sysfs created");
+  const auto catalog = counters::pmu_catalog::discover(root);
+  check(catalog.pmus().size() == 2, "PMUs without a type are skipped");
+  check(catalog.events().size() == 5,
+        "companion files and unknown terms are skipped");
+
+  const counters::pmu_event *slots = catalog.find("", "topdown-slots");
+  check(slots != nullptr && slots->pmu == "cpu",
+        "the core PMU is preferred for bare names");
+  check(slots != nullptr && slots->config.type == 4 &&
+            slots->config.config == 0x400,
+        "topdown-slots is encoded from its format");
+  const counters::pmu_event *uncore = catalog.find("uncore", "topdown-slots");
+  check(uncore != nullptr && uncore->config.type == 17 &&
+            uncore->config.config == 0x2,
+        "events can be looked up per PMU");
+  const counters::pmu_event *stalls = catalog.find("cpu", "mem-stalls");
+  check(stalls != nullptr && stalls->config.config == 0x140014a3,
+        "decimal and hexadecimal values are accepted");
+
+  counters::perf_event_config config{0, 0};
+  check(catalog.resolve("cpu/event=0x3c,edge,offcore=0x1ab/", config) &&
+            config.type == 4 && config.config == 0x4003c &&
+            config.config1 == 0x1000000ab,
+        "terms are deposited into split bit ranges");
+  check(!catalog.resolve("cpu/event=0x3c,bogus=1/", config),
+        "unknown terms are rejected");
+  check(!catalog.resolve("nopmu/event=0x3c/", config),
+        "unknown PMUs are rejected");
+
+  auto list = counters::event_list::parse(
+      "cycles,cpu/event=0xa3,umask=0x14,cmask=0x14/,topdown-slots,"
+      "uncore/clockticks/,cycle-activity.stalls-mem",
+      &catalog);
+  check(list.size() == 5, "PMU events are not split on their commas");
+  check(list.name(1) == "cpu/event=0xa3,umask=0x14,cmask=0x14/",
+        "PMU events keep their spelling");
+  check(has_config(list, 1, 4, 0x140014a3), "PMU terms are resolved");
+  check(has_config(list, 2, 4, 0x400), "bare sysfs names are resolved");
+  check(has_config(list, 3, 17, 0xff), "pmu/name/ is resolved");
+  check(has_config(list, 4, 4, 0x140014a3), "dotted event names are resolved");
+  bool thrown = false;
+  try {
+    counters::event_list::parse("cpu/nothing/", &catalog);
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  check(thrown, "unknown PMU events are rejected");
+  nftw(root.c_str(), remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+}
+
+int main() {
+  test_pmu_catalog();
+
+  auto list = counters::event_list::parse(
+      "cycles,instructions, L1-dcache-load-misses ,dTLB-load-misses,r01c4");
+  check(list.size() == 5, "five events parsed");
+  check(has_config(list, 0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+        "cycles is a hardware event");
+  check(has_config(list, 2, PERF_TYPE_HW_CACHE,
+                   PERF_COUNT_HW_CACHE_L1D |
+                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)),
+        "L1-dcache-load-misses is a cache event");
+  check(has_config(list, 3, PERF_TYPE_HW_CACHE,
+                   PERF_COUNT_HW_CACHE_DTLB |
+                       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)),
+        "dTLB-load-misses is a cache event");
+  check(has_config(list, 4, PERF_TYPE_RAW, 0x1c4), "r01c4 is a raw event");
+  check(list.index_of("dTLB-load-misses") == 3, "index_of finds an event");
+  check(list.index_of("branches") == counters::event_list::npos,
+        "index_of reports missing events");
+
+  auto cache = counters::event_list::parse("LLC-loads,iTLB-store-misses,L1-dcache-prefetches");
+  check(has_config(cache, 0, PERF_TYPE_HW_CACHE,
+                   PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                       (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16)),
+        "LLC-loads counts accesses");
+  check(cache.configs()[2].config ==
+            (PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_PREFETCH << 8)),
+        "prefetches use the plural form");
+
+  for (const char *bad : {"bogus", "r", "rxyz", "L1-dcache-loads-misses"}) {
+    bool thrown = false;
+    try {
+      counters::event_list::parse(bad);
+    } catch (const std::invalid_argument &) {
+      thrown = true;
+    }
+    check(thrown, bad);
+  }
+
+  // Software events are usually available even without PMU access.
+  auto software = counters::event_list::parse("task-clock,page-faults");
+  counters::bench_parameter p;
+  p.min_time_ns = 10'000'000;
+  auto agg = counters::bench(software, [] {
+    volatile int s = 0;
+    for (int i = 0; i < 100; ++i) s += i;
+  }, p);
+  printf("runtime list: task-clock=%f page-faults=%f\n",
+         agg.get(software.index_of("task-clock")),
+         agg.get(software.index_of("page-faults")));
+  check(agg.confidence(software.size()) == counters::count_confidence::missing,
+        "unused slots are missing");
+
+  if (failures != 0) {
+    return EXIT_FAILURE;
+  }
+  printf("event spec tests passed\n");
+  return EXIT_SUCCESS;
+}
+#else
+int main() {
+  printf("event lists are only supported on Linux\n");
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,75 @@
+#include "counters/bench.h"
+#include <cstdio>
+#include <cstdlib>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  if (!condition) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+volatile int sink = 0;
+
+int main() {
+  using counters::latency_histogram;
+  for (uint64_t value : {uint64_t(0), uint64_t(1), uint64_t(127), uint64_t(128),
+                         uint64_t(1000), uint64_t(123456789), UINT64_MAX}) {
+    const size_t index = latency_histogram::index_of(value);
+    check(index < latency_histogram::bucket_count, "index in range");
+    check(latency_histogram::lowest_in_bucket(index) <= value &&
+              value <= latency_histogram::highest_in_bucket(index),
+          "value within its bucket");
+    check(double(latency_histogram::highest_in_bucket(index) -
+                 latency_histogram::lowest_in_bucket(index)) <=
+              double(value) / 64,
+          "bucket width bounded by 1/64 of the value");
+  }
+
+  latency_histogram small;
+  for (uint64_t v = 1; v <= 100; v++) {
+    small.record(v);
+  }
+  check(small.count() == 100 && small.min() == 1 && small.max() == 100,
+        "count, min and max");
+  check(small.percentile(50) == 50 && small.percentile(99) == 99 &&
+            small.percentile(100) == 100,
+        "small values are exact");
+  check(small.mean() == 50.5, "mean");
+
+  latency_histogram large;
+  large.record(1000000, 990);
+  large.record(50000000, 10);
+  check(large.percentile(50) >= 1000000 && large.percentile(50) < 1016000,
+        "median within the relative error");
+  check(large.percentile(99.9) == 50000000, "tail capped by the maximum");
+  large.merge(small);
+  check(large.count() == 1100 && large.min() == 1, "merge");
+  large.clear();
+  check(large.count() == 0 && large.percentile(50) == 0, "clear");
+
+  counters::bench_parameter p;
+  p.min_time_ns = 50'000'000;
+  p.subtract_overhead = true;
+  auto latency = counters::bench_latency([] {
+    for (int i = 0; i < 100; ++i) sink = sink + i;
+  }, p);
+  printf("latency (%s, %llu calls): p50=%.1f ns p90=%.1f ns p99=%.1f ns "
+         "p99.9=%.1f ns max=%.1f ns timer overhead=%.1f ns\n",
+         latency.cycle_counter ? "cycle counter" : "steady_clock",
+         (unsigned long long)latency.calls(), latency.p50_ns(),
+         latency.p90_ns(), latency.p99_ns(), latency.p999_ns(),
+         latency.max_ns(), latency.timer_overhead_ns());
+  check(latency.calls() >= p.min_repeat, "latency calls recorded");
+  check(latency.p50_ns() <= latency.p99_ns() &&
+            latency.p99_ns() <= latency.max_ns(),
+        "percentiles are ordered");
+
+  if (failures != 0) {
+    return EXIT_FAILURE;
+  }
+  printf("histogram tests passed\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+#include "counters/parallel.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  if (!condition) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+int main() {
+  counters::bench_parameter params;
+  params.min_repeat = 10;
+  params.min_time_ns = 20'000'000;
+  params.max_repeat = 1000;
+
+  std::vector<std::atomic<size_t>> calls(4);
+  auto curve = counters::bench_parallel([&calls](size_t thread) {
+    volatile int s = 0;
+    for (int i = 0; i < 1000; ++i) s += i;
+    calls[thread].fetch_add(1, std::memory_order_relaxed);
+  }, {1, 2, 4}, params);
+
+  check(curve.size() == 3, "one result per thread count");
+  for (const auto &point : curve) {
+    printf("%zu threads%s: %.0f calls/s, speedup %.2f, efficiency %.2f, "
+           "%d rounds of %d calls, instructions per call %f\n",
+           point.threads, point.pinned ? " (pinned)" : "",
+           point.calls_per_second(), point.speedup, point.efficiency,
+           point.merged.iteration_count(), point.merged.inner_iteration_count(),
+           point.merged.instructions());
+    check(point.per_thread.size() == point.threads, "one aggregate per thread");
+    check(point.merged.inner_iteration_count() ==
+              int(point.threads) * point.per_thread.front().inner_iteration_count(),
+          "merged samples hold every thread's calls");
+    for (const auto &thread : point.per_thread) {
+      check(thread.iteration_count() == point.merged.iteration_count(),
+            "every thread takes part in every round");
+    }
+    check(point.calls_per_second() > 0 && point.efficiency > 0,
+          "throughput and efficiency");
+  }
+  check(curve.front().speedup == 1, "the first thread count is the baseline");
+  check(calls[3].load() > 0, "worker indexes reach the thread count");
+
+  if (failures != 0) {
+    return EXIT_FAILURE;
+  }
+  printf("parallel tests passed\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,319 @@
+#include "counters/bench.h"
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  if (!condition) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+static bool near(double value, double expected, double tolerance) {
+  return std::fabs(value - expected) <= tolerance;
+}
+
+volatile int sink = 0;
+
+int main() {
+  counters::running_statistics moments;
+  for (double x : {2.0, 4.0, 4.0, 4.0, 5.0, 5.0, 7.0, 9.0}) {
+    moments.update(x);
+  }
+  check(moments.count() == 8 && near(moments.mean(), 5, 1e-12) &&
+            near(moments.variance(), 32.0 / 7, 1e-12),
+        "Welford mean and variance");
+  counters::running_statistics left, right;
+  for (int i = 0; i < 100; i++) {
+    (i < 30 ? left : right).update(i);
+  }
+  left.merge(right);
+  check(near(left.mean(), 49.5, 1e-9) && near(left.variance(), 841.6666666, 1e-6),
+        "merged moments");
+
+  counters::quantile_sketch exact;
+  for (int v = 1; v <= 101; v++) {
+    exact.update(v);
+  }
+  check(near(exact.median(), 51, 1.01) && exact.min() == 1 && exact.max() == 101,
+        "median of a small stream");
+  check(near(exact.mad(), 25, 2), "MAD of a uniform stream");
+
+  // One million normal values: quantiles and MAD within a small error.
+  std::mt19937_64 rng(42);
+  std::normal_distribution<double> normal(1000, 100);
+  counters::quantile_sketch a, b;
+  for (int i = 0; i < 1000000; i++) {
+    (i % 2 == 0 ? a : b).update(normal(rng));
+  }
+  a.merge(b);
+  check(a.count() == 1000000, "merged count");
+  check(near(a.median(), 1000, 2), "median of a normal stream");
+  check(near(a.quantile(0.99), 1000 + 2.326 * 100, 5), "p99 of a normal stream");
+  check(near(a.quantile(0.001), 1000 - 3.090 * 100, 10),
+        "p0.1 of a normal stream");
+  check(near(a.mad(), 0.6745 * 100, 3), "MAD of a normal stream");
+  a.shift(-1000);
+  check(near(a.median(), 0, 2), "shift");
+
+  counters::bench_parameter p;
+  p.min_time_ns = 50'000'000;
+  auto agg = counters::bench([] {
+    for (int i = 0; i < 100; ++i) sink = sink + i;
+  }, p);
+  const counters::sample_summary time = agg.elapsed_summary();
+  printf("elapsed per call over %llu samples: mean=%.2f ns stddev=%.2f "
+         "stderr=%.3f median=%.2f p90=%.2f p99=%.2f mad=%.2f "
+         "min=%.2f max=%.2f\n",
+         (unsigned long long)time.samples, time.mean, time.stddev,
+         time.standard_error, time.median, time.p90, time.p99, time.mad,
+         time.min, time.max);
+  check(time.samples == uint64_t(agg.iteration_count()), "one value per sample");
+  check(near(time.mean, agg.elapsed_ns(), 1e-6 * agg.elapsed_ns()),
+        "streaming mean matches the aggregate");
+  check(time.min <= time.median && time.median <= time.max &&
+            near(time.min, agg.fastest_elapsed_ns(), 1e-9) &&
+            near(time.max, agg.slowest_elapsed_ns(), 1e-9),
+        "min and max match the best and worst samples");
+
+  check(near(counters::normal_quantile(0.975), 1.959964, 1e-6) &&
+            near(counters::normal_quantile(0.005), -2.575829, 1e-6) &&
+            counters::normal_quantile(0.5) == 0,
+        "normal quantiles");
+
+  // Adaptive stopping: as many samples as needed for a +/-1% median.
+  counters::bench_parameter adaptive;
+  adaptive.target_precision = 0.01;
+  adaptive.adaptive_max_time_ns = 1'000'000'000;
+  const auto adaptive_start = std::chrono::steady_clock::now();
+  auto converging = counters::bench([] {
+    for (int i = 0; i < 100; ++i) sink = sink + i;
+  }, adaptive);
+  const double adaptive_ms = std::chrono::duration<double, std::milli>(
+                                 std::chrono::steady_clock::now() - adaptive_start)
+                                 .count();
+  const auto interval = converging.elapsed_median_interval();
+  printf("adaptive: %s after %d samples in %.1f ms, median in [%.2f, %.2f] ns\n",
+         converging.converged ? "converged" : "budget exhausted",
+         converging.iteration_count(), adaptive_ms, interval.first,
+         interval.second);
+  check(interval.first <= interval.second, "ordered median interval");
+  check(adaptive_ms < 3000, "adaptive stopping respects its budget");
+  check(!converging.converged ||
+            (interval.second - interval.first) / 2 <=
+                0.0101 * converging.elapsed_summary().median,
+        "converged means within the target");
+
+  // Mann-Kendall: a trend, a level shift and noise without a trend.
+  std::vector<double> trend(40), shifted(40), flat(40);
+  std::mt19937_64 noise(7);
+  std::uniform_real_distribution<double> jitter(0, 1);
+  for (size_t i = 0; i < 40; i++) {
+    trend[i] = 100 - double(i) + 5 * jitter(noise);
+    shifted[i] = (i < 20 ? 150 : 100) + 5 * jitter(noise);
+    flat[i] = 100 + 5 * jitter(noise);
+  }
+  check(counters::trend_z_score(trend.data(), trend.size()) < -1.96 &&
+            counters::trend_z_score(shifted.data(), shifted.size()) < -1.96 &&
+            std::fabs(counters::trend_z_score(flat.data(), flat.size())) < 1.96,
+        "trend test");
+  // Two pairs of equal values: S = 4, and the ties take 2 * 18 from
+  // n(n - 1)(2n + 5) = 156 in the variance.
+  const double tied[] = {1, 1, 2, 2};
+  check(near(counters::trend_z_score(tied, 4), 3 / std::sqrt(120.0 / 18), 1e-12),
+        "tie-corrected trend test");
+
+  // Warm-up until the samples are stationary; the first calls are slow.
+  counters::bench_parameter steady = p;
+  steady.steady_state_warmup = true;
+  steady.max_warmup_ns = 500'000'000;
+  int calls = 0;
+  auto warmed = counters::bench([&calls] {
+    const int work = calls++ < 2000 ? 2000 : 100;
+    for (int i = 0; i < work; ++i) sink = sink + i;
+  }, steady);
+  printf("warm-up: %zu samples in %.2f ms, %s\n", warmed.warmup_samples,
+         warmed.warmup_ns / 1e6,
+         warmed.steady_state ? "steady state" : "cap reached");
+  check(warmed.warmup_samples >= steady.min_repeat &&
+            warmed.warmup_ns > 0 && warmed.warmup_ns < 1e9,
+        "warm-up is reported and capped");
+
+  // Aggregates of shards merge like one aggregate of every sample.
+  using count = counters::event_count;
+  auto sample = [](size_t i) {
+    const double ns = 1000 + double((i * 7919) % 997);
+    return count(std::chrono::duration<double>(ns * 1e-9),
+                 {{100 + i % 13, 400 + i % 31, 50, i % 3, i % 5}});
+  };
+  counters::event_aggregate all, shard_a, shard_b, shard_c;
+  for (size_t i = 0; i < 3000; i++) {
+    all << sample(i);
+    (i < 1000 ? shard_a : i < 2000 ? shard_b : shard_c) << sample(i);
+  }
+  counters::event_aggregate sequential = shard_a, tail = shard_b;
+  sequential.merge(shard_b);
+  sequential.merge(shard_c);
+  tail.merge(shard_c);
+  counters::event_aggregate right_first = shard_a;
+  right_first.merge(tail);
+  for (const auto *merged : {&sequential, &right_first}) {
+    check(merged->iterations == all.iterations &&
+              merged->total.event_counts == all.total.event_counts &&
+              merged->best.elapsed == all.best.elapsed &&
+              merged->worst.elapsed == all.worst.elapsed &&
+              near(merged->elapsed_ns(), all.elapsed_ns(), 1e-9 * all.elapsed_ns()),
+          "merged totals, minima and maxima");
+    check(merged->elapsed_statistics.moments.count() == 3000 &&
+              near(merged->elapsed_summary().stddev, all.elapsed_summary().stddev, 1e-9) &&
+              near(merged->summary<counters::events::instructions>().mean,
+                   all.summary<counters::events::instructions>().mean, 1e-9) &&
+              near(merged->elapsed_summary().median, all.elapsed_summary().median, 5),
+          "merged streaming statistics");
+  }
+  const std::string bytes = sequential.serialize();
+  const auto restored = counters::event_aggregate::deserialize(bytes);
+  check(restored.serialize() == bytes && restored.iterations == sequential.iterations &&
+            restored.elapsed_summary().p99 == sequential.elapsed_summary().p99,
+        "serialization round trip");
+  printf("serialized aggregate: %zu bytes for %d samples\n", bytes.size(),
+         restored.iterations);
+  bool rejected = false;
+  try {
+    counters::event_aggregate::deserialize(bytes.substr(0, bytes.size() / 2));
+  } catch (const std::invalid_argument &) {
+    rejected = true;
+  }
+  check(rejected, "truncated data is rejected");
+  // Different inner counts: 2 and 3 calls per sample become 6.
+  counters::event_aggregate twice, thrice;
+  twice << count(std::chrono::duration<double>(20e-9), {{20, 20, 0, 0, 0}});
+  twice.inner_count = 2;
+  thrice << count(std::chrono::duration<double>(60e-9), {{60, 60, 0, 0, 0}});
+  thrice.inner_count = 3;
+  twice.merge(thrice);
+  check(twice.inner_count == 6 && twice.iterations == 2 &&
+            near(twice.elapsed_ns(), 15, 1e-9) && near(twice.cycles(), 15, 1e-9) &&
+            near(twice.fastest_elapsed_ns(), 10, 1e-9) &&
+            near(twice.slowest_elapsed_ns(), 20, 1e-9),
+        "merging different inner counts keeps per-call values");
+
+  // A multiplexed event that missed half of the samples: its mean is over
+  // the samples that counted it.
+  counters::event_aggregate rotated;
+  for (int i = 0; i < 4; i++) {
+    count missed(std::chrono::duration<double>(30e-6), {{100, 0, 0, 0, 0}});
+    if (i % 2 == 1) {
+      missed.event_counts[1] = 80;
+    } else {
+      missed.coverage[1] = 0;
+    }
+    rotated << missed;
+  }
+  check(rotated.counted_samples(1) == 2 && near(rotated.instructions(), 80, 1e-9) &&
+            near(rotated.cycles(), 100, 1e-9),
+        "means of partly counted events");
+
+  // Same, from the coverage that a multiplexing collector reports for short
+  // samples: every sample's coverage is its own, so an event that did not
+  // run in a sample is left out of that sample.
+  counters::collector_options multiplexed;
+  multiplexed.scheduling = counters::event_scheduling::multiplex;
+  namespace ev = counters::events;
+  counters::basic_event_collector<ev::cycles, ev::instructions, ev::branches,
+                                  ev::branch_misses, ev::cache_references,
+                                  ev::cache_misses, ev::l1d_misses,
+                                  ev::llc_misses, ev::task_clock>
+      rotating(multiplexed);
+  decltype(rotating)::aggregate_type from_collector;
+  constexpr size_t rotating_events = decltype(rotating)::event_set_type::size;
+  std::array<size_t, rotating_events> counted{};
+  std::array<double, rotating_events> sums{};
+  bool valid_coverage = true;
+  for (int sample = 0; sample < 200; sample++) {
+    rotating.start();
+    for (int i = 0; i < 1000; ++i) sink = sink + i;
+    const auto &measured = rotating.end();
+    for (size_t i = 0; i < rotating_events; i++) {
+      const float coverage = measured.coverage[i];
+      valid_coverage = valid_coverage && coverage >= 0 && coverage <= 1 &&
+                       (coverage > 0 || measured.event_counts[i] == 0);
+      if (coverage > 0) {
+        counted[i]++;
+        sums[i] += double(measured.event_counts[i]);
+      }
+    }
+    from_collector << measured;
+  }
+  check(valid_coverage, "per-sample coverage is in [0, 1]");
+  bool counted_means = true;
+  for (size_t i = 0; i < rotating_events; i++) {
+    const double mean = counted[i] == 0 ? 0 : sums[i] / double(counted[i]);
+    counted_means = counted_means &&
+                    from_collector.counted_samples(i) == counted[i] &&
+                    near(from_collector.get(i), mean, 1e-9 * mean + 1e-9);
+  }
+  check(counted_means, "means of multiplexed events over the samples that counted them");
+  check(from_collector.counted_samples(rotating_events - 1) == 200 &&
+            from_collector.confidence<ev::task_clock>() == counters::count_confidence::exact,
+        "a software event is counted in every multiplexed sample");
+
+  // An overhead above some samples: the statistics are clamped at zero like
+  // the totals and the best sample.
+  counters::event_aggregate cheap;
+  for (unsigned long long cycles : {10ull, 20ull, 30ull, 40ull, 200ull}) {
+    cheap << count(std::chrono::duration<double>(double(cycles) * 1e-9),
+                   {{cycles, cycles, 0, 0, 0}});
+  }
+  counters::basic_event_overhead<counters::default_event_set> cost;
+  cost.samples = 1;
+  cost.median = count(std::chrono::duration<double>(35e-9), {{35, 35, 0, 0, 0}});
+  cheap.subtract_overhead(cost);
+  const auto cheap_cycles = cheap.summary<counters::events::cycles>();
+  const auto cheap_time = cheap.elapsed_summary();
+  check(cheap_cycles.min == 0 && cheap.fastest_cycles() == 0 &&
+            cheap_cycles.median >= 0 && near(cheap_cycles.max, 165, 1e-9) &&
+            near(cheap_cycles.mean, 25, 1e-9) && near(cheap.cycles(), 25, 1e-9) &&
+            cheap_time.min == 0 && near(cheap_time.max, 165, 1e-6),
+        "subtracted overhead is clamped in the streaming statistics");
+
+  // Every sample, kept in a preallocated arena.
+  counters::sample_arena arena(p.max_repeat);
+  auto stored = counters::bench([] {
+    for (int i = 0; i < 100; ++i) sink = sink + i;
+  }, p, arena);
+  check(arena.size() == size_t(stored.iteration_count()) && arena.dropped() == 0,
+        "the arena holds every sample");
+  check(arena.inner_count() == size_t(stored.inner_iteration_count()),
+        "the arena knows the inner count");
+  double sum = 0;
+  for (double ns : arena.elapsed_ns()) {
+    sum += ns;
+  }
+  check(near(sum, stored.total_elapsed_ns(), 1e-6 * sum),
+        "the arena's elapsed times add up to the total");
+  check(arena.counts_of<counters::events::instructions>().size() == arena.size(),
+        "one count per sample");
+  counters::sample_arena small(3);
+  counters::bench_parameter few = p;
+  few.max_repeat = 3;
+  few.min_repeat = 5;
+  counters::bench([] { sink = sink + 1; }, few, small);
+  check(small.size() == 5 && small.dropped() == 0,
+        "the arena grows to min_repeat samples");
+
+  if (failures != 0) {
+    return EXIT_FAILURE;
+  }
+  printf("statistics tests passed\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+#include "counters/system_wide.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  if (!condition) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+volatile int sink = 0;
+
+int main() {
+  const std::vector<int> parsed = counters::internal::parse_cpu_list("0-2,5,7-8\n");
+  check(parsed == std::vector<int>({0, 1, 2, 5, 7, 8}), "CPU list parsing");
+  check(!counters::internal::online_cpus().empty(), "online CPUs");
+
+  counters::system_collector machine;
+  machine.start();
+  for (int i = 0; i < 1000000; ++i) sink = sink + i;
+  const auto &window = machine.end();
+  check(window.total.elapsed_ns() > 0, "the window is timed");
+  check(window.cpus.size() == window.per_cpu.size() &&
+            window.cpus == machine.counted_cpus(),
+        "one count per counted CPU");
+  if (!machine.has_events()) {
+    printf("system-wide counting unavailable: %s\n",
+           machine.unavailable_reason().c_str());
+    check(!machine.unavailable_reason().empty(), "a reason is given");
+    check(window.cpus.empty() &&
+              window.total.confidence<counters::events::instructions>() ==
+                  counters::count_confidence::missing,
+          "nothing is reported without counters");
+  } else {
+    constexpr size_t instructions =
+        counters::default_event_set::index_of<counters::events::instructions>();
+    unsigned long long sum = 0;
+    for (size_t i = 0; i < window.cpus.size(); i++) {
+      printf("cpu %d: %.0f instructions\n", window.cpus[i],
+             window.per_cpu[i].instructions());
+      sum += window.per_cpu[i].event_counts[instructions];
+    }
+    check(sum == window.total.event_counts[instructions], "the total sums the CPUs");
+    check(window.total.instructions() >= 1000000,
+          "the calling thread's work is included");
+  }
+
+  if (failures != 0) {
+    return EXIT_FAILURE;
+  }
+  printf("system-wide tests passed\n");
+  return EXIT_SUCCESS;
+}
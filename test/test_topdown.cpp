@@ -0,0 +1,112 @@
+#include "counters/topdown.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(__linux__)
+static int failures = 0;
+
+static void check(bool condition, const char *what) {
+  if (!condition) {
+    printf("FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+static bool near(double value, double expected) {
+  return std::fabs(value - expected) < 1e-9;
+}
+
+using aggregate_type =
+    counters::basic_event_aggregate<counters::runtime_event_set<>>;
+
+// One sample with the given counts; events past `counts` were not counted.
+static aggregate_type make_aggregate(std::initializer_list<double> counts) {
+  aggregate_type aggregate;
+  counters::basic_event_count<counters::runtime_event_set<>> sample;
+  sample.coverage.fill(0);
+  size_t i = 0;
+  for (double count : counts) {
+    sample.event_counts[i] = (unsigned long long)count;
+    sample.coverage[i] = count < 0 ? 0 : 1;
+    i++;
+  }
+  aggregate << sample;
+  return aggregate;
+}
+
+int main() {
+  counters::event_list slots;
+  for (const char *name :
+       {"slots", "topdown-retiring", "topdown-bad-spec", "topdown-fe-bound",
+        "topdown-be-bound", "topdown-heavy-ops", "topdown-br-mispredict",
+        "topdown-fetch-lat", "topdown-mem-bound", "cycles", "instructions"}) {
+    slots.add(name, counters::perf_event_config{4, 0});
+  }
+  auto tma = counters::topdown_analyze(
+      slots, make_aggregate({1000, 400, 100, 200, 300, 50, 80, 150, 120, 250,
+                             500}));
+  check(tma.method == counters::topdown_method::slots, "slots method");
+  check(near(tma.retiring, 0.4) && near(tma.bad_speculation, 0.1) &&
+            near(tma.frontend_bound, 0.2) && near(tma.backend_bound, 0.3),
+        "level 1 from slots");
+  check(tma.has_level2 && near(tma.light_operations, 0.35) &&
+            near(tma.machine_clears, 0.02) && near(tma.fetch_bandwidth, 0.05) &&
+            near(tma.core_bound, 0.18),
+        "level 2 from slots");
+  check(near(tma.ipc, 2), "ipc");
+
+  auto level1 = counters::topdown_analyze(
+      slots, make_aggregate({1000, 400, 100, 200, 300, -1, -1, -1, -1}));
+  check(level1.method == counters::topdown_method::slots && !level1.has_level2,
+        "level 2 needs its events");
+
+  auto stalls = counters::event_list::parse(
+      "cycles,instructions,stalled-cycles-frontend,stalled-cycles-backend");
+  auto approx =
+      counters::topdown_analyze(stalls, make_aggregate({1000, 800, 250, 500}));
+  check(approx.method == counters::topdown_method::stalled_cycles &&
+            near(approx.frontend_bound, 0.25) &&
+            near(approx.backend_bound, 0.5) && near(approx.retiring, 0.25) &&
+            std::isnan(approx.bad_speculation),
+        "level 1 from stalled cycles");
+  auto frontend_only =
+      counters::topdown_analyze(stalls, make_aggregate({1000, 800, 250, -1}));
+  check(frontend_only.method == counters::topdown_method::stalled_cycles &&
+            std::isnan(frontend_only.backend_bound) &&
+            std::isnan(frontend_only.retiring),
+        "a single stall event is reported alone");
+  auto none = counters::topdown_analyze(stalls, make_aggregate({}));
+  check(none.method == counters::topdown_method::unavailable,
+        "nothing counted");
+
+  auto result = counters::bench_topdown([] {
+    volatile int s = 0;
+    for (int i = 0; i < 1000; ++i) s += i;
+  });
+  const auto &b = result.breakdown;
+  printf("top-down (%s): frontend %.3f, bad speculation %.3f, retiring %.3f, "
+         "backend %.3f, ipc %.2f\n",
+         counters::topdown_method_name(b.method), b.frontend_bound,
+         b.bad_speculation, b.retiring, b.backend_bound, b.ipc);
+  if (b.has_level2) {
+    printf("  fetch latency %.3f, fetch bandwidth %.3f, branch mispredicts "
+           "%.3f, machine clears %.3f,\n  heavy ops %.3f, light ops %.3f, "
+           "memory bound %.3f, core bound %.3f\n",
+           b.fetch_latency, b.fetch_bandwidth, b.branch_mispredicts,
+           b.machine_clears, b.heavy_operations, b.light_operations,
+           b.memory_bound, b.core_bound);
+  }
+
+  if (failures != 0) {
+    return EXIT_FAILURE;
+  }
+  printf("top-down tests passed\n");
+  return EXIT_SUCCESS;
+}
+#else
+int main() {
+  printf("top-down analysis is only supported on Linux\n");
+  return EXIT_SUCCESS;
+}
+#endif